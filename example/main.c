@@ -2,12 +2,17 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include "web/http_server.h"
+#include "web/config.h"
+#include "mevent/servermanager.h"
+#include "mevent/epoll.h"
+#include "mevent/allocator.h"
 #include "misc/logger.h"
 
 
 #define DEFAULT_PORT  2019   //默认端口
 #define THREAD_NUM    0      //线程数量
 
+extern config server_config;
 
 int main(int argc, char* argv[])  
 {
@@ -17,8 +22,21 @@ int main(int argc, char* argv[])
     int thread_num = THREAD_NUM;
     int* p_port = NULL;
     int* p_thread_num = NULL;
+    int reuse_port = 0;
+    int dispatch_policy = DISPATCH_ROUND_ROBIN;
+    char* cpu_affinity = NULL;
+    int edge_triggered = 0;
+    int io_backend = IO_BACKEND_EPOLL;
+    int max_events = 0;
+    int stats_interval = 0;
+    int busy_poll = 0;
+    int busy_poll_socket = 0;
+    int keep_alive_timeout = -1;
+    int keep_alive_requests = -1;
+    int allocator = -1;
+    int rebalance_interval = 0;
 
-    while ((c = getopt(argc, argv, "h:p:w:")) != -1) {
+    while ((c = getopt(argc, argv, "h:p:w:rd:R:c:eum:s:b:Bt:k:a:")) != -1) {
         switch (c) {
         case 'h':
             host = optarg;
@@ -31,8 +49,53 @@ int main(int argc, char* argv[])
             thread_num = atoi(optarg);
             p_thread_num = &thread_num;
             break;
+        case 'r':
+            reuse_port = 1;
+            break;
+        case 'd':
+            dispatch_policy = dispatch_policy_from_name(optarg);
+            if (dispatch_policy < 0)  {
+                debug_quit("unknown dispatch policy %s, should be rr, conn, bytes or p2c\n\n", optarg);
+            }
+            break;
+        case 'R':
+            rebalance_interval = atoi(optarg);
+            break;
+        case 'c':
+            cpu_affinity = optarg;
+            break;
+        case 'e':
+            edge_triggered = 1;
+            break;
+        case 'u':
+            io_backend = IO_BACKEND_URING;
+            break;
+        case 'm':
+            max_events = atoi(optarg);
+            break;
+        case 's':
+            stats_interval = atoi(optarg);
+            break;
+        case 'b':
+            busy_poll = atoi(optarg);
+            break;
+        case 'B':
+            busy_poll_socket = 1;
+            break;
+        case 't':
+            keep_alive_timeout = atoi(optarg);
+            break;
+        case 'k':
+            keep_alive_requests = atoi(optarg);
+            break;
+        case 'a':
+            allocator = mem_allocator_from_name(optarg);
+            if (allocator < 0)  {
+                debug_quit("unknown allocator %s, should be libc, arena or hugepage\n\n", optarg);
+            }
+            break;
         default:
-            debug_quit("Usage: -h hostname -p port -w woker_thread_num\n\n");
+            debug_quit("Usage: -h hostname -p port -w woker_thread_num [-r] [-d rr|conn|bytes|p2c] [-R rebalance_ms] [-c cpu_list] [-e] [-u] [-m max_events] [-s stats_ms] [-b busy_poll_us] [-B] [-t keep_alive_s] [-k keep_alive_requests] [-a libc|arena|hugepage]\n\n");
             break;
         }
     }
@@ -43,6 +106,27 @@ int main(int argc, char* argv[])
     debug_msg("port, thread_num is %d, %d \n", port, thread_num);
 
     http_server_init();
+    server_config.reuse_port = reuse_port;
+    server_config.dispatch_policy = dispatch_policy;
+    server_config.rebalance_interval = rebalance_interval;
+    server_config.cpu_affinity = cpu_affinity;
+    server_config.edge_triggered = edge_triggered;
+    server_config.io_backend = io_backend;
+    if (max_events > 0)  {
+        server_config.max_events = max_events;
+    }
+    server_config.stats_interval = stats_interval;
+    server_config.busy_poll = busy_poll;
+    server_config.busy_poll_socket = busy_poll_socket;
+    if (keep_alive_timeout >= 0)  {
+        server_config.timeout_keep_alive = keep_alive_timeout;
+    }
+    if (keep_alive_requests >= 0)  {
+        server_config.max_keep_alive_requests = keep_alive_requests;
+    }
+    if (allocator >= 0)  {
+        server_config.allocator = allocator;
+    }
     http_server_start(host, p_port, p_thread_num);
 
 	return 0;
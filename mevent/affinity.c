@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "affinity.h"
+#include "config.h"
+
+#include "misc/logger.h"
+
+#define MPOL_LOCAL_ 4         //linux/mempolicy.h中的MPOL_LOCAL，内存从当前线程所在节点分配
+#define MAX_NODE_NUM 64
+
+
+int cpu_online_num()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+/* 进程可以运行的cpu，编号可能不连续(下线或隔离的核)，取不到时退回0到在线数-1 */
+static int cpu_list_all(int* cpus, int max)
+{
+    int num = 0;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)  {
+        int cpu;
+        for (cpu = 0; cpu < CPU_SETSIZE && num < max; cpu++)  {
+            if (CPU_ISSET(cpu, &set))  {
+                cpus[num++] = cpu;
+            }
+        }
+        if (num > 0)  {
+            return num;
+        }
+    }
+    int n = cpu_online_num();
+    for (; num < n && num < max; num++)  {
+        cpus[num] = num;
+    }
+    return num;
+}
+
+/* 解析"0-3,8,10-11"这样的列表，"all"表示进程可以运行的所有cpu，返回cpu个数 */
+int cpu_list_parse(const char* str, int* cpus, int max)
+{
+    int num = 0;
+    if (str == NULL)  {
+        return 0;
+    }
+    if (strcmp(str, "all") == 0)  {
+        return cpu_list_all(cpus, max);
+    }
+
+    const char* p = str;
+    while (*p && num < max)  {
+        char* end;
+        int first = (int)strtol(p, &end, 10);
+        if (end == p || first < 0)  {
+            return -1;
+        }
+        int last = first;
+        p = end;
+        if (*p == '-')  {
+            p++;
+            last = (int)strtol(p, &end, 10);
+            if (end == p || last < first)  {
+                return -1;
+            }
+            p = end;
+        }
+        for (; first <= last && num < max; first++)  {
+            cpus[num++] = first;
+        }
+        if (*p == ',')  {
+            p++;
+        }
+        else if (*p)  {
+            return -1;
+        }
+    }
+    return num;
+}
+
+static int node_has_cpu(int node, int cpu)
+{
+    char path[64];
+    char buf[1024];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL)  {
+        return -1;
+    }
+    int found = 0;
+    if (fgets(buf, sizeof(buf), fp))  {
+        buf[strcspn(buf, "\n")] = '\0';
+        int cpus[1024];
+        int n = cpu_list_parse(buf, cpus, 1024);
+        int i;
+        for (i = 0; i < n; i++)  {
+            if (cpus[i] == cpu)  {
+                found = 1;
+                break;
+            }
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+/* 从sysfs查cpu所在的NUMA节点，查不到返回-1 */
+int cpu_numa_node(int cpu)
+{
+    int node;
+    for (node = 0; node < MAX_NODE_NUM; node++)  {
+        int ret = node_has_cpu(node, cpu);
+        if (ret == 1)  {
+            return node;
+        }
+    }
+    return -1;
+}
+
+/* 把cpu列表重排成各节点轮流出现，这样前几个工作线程就分散在不同的节点上 */
+void cpu_list_spread_nodes(int* cpus, int num)
+{
+    int* nodes = (int*)mu_malloc(MEM_TAG_MISC, sizeof(int) * num);
+    int* sorted = (int*)mu_malloc(MEM_TAG_MISC, sizeof(int) * num);
+    if (nodes == NULL || sorted == NULL)  {
+        mu_free(nodes);
+        mu_free(sorted);
+        return;
+    }
+
+    int i;
+    int max_node = -1;
+    for (i = 0; i < num; i++)  {
+        nodes[i] = cpu_numa_node(cpus[i]);
+        if (nodes[i] > max_node)
+            max_node = nodes[i];
+    }
+
+    int n = 0;
+    int round;
+    for (round = 0; n < num; round++)  {     //每一轮从每个节点取出它的第round个cpu
+        int node;
+        for (node = -1; node <= max_node; node++)  {
+            int seen = 0;
+            for (i = 0; i < num; i++)  {
+                if (nodes[i] != node)
+                    continue;
+                if (seen++ == round)  {
+                    sorted[n++] = cpus[i];
+                    break;
+                }
+            }
+        }
+    }
+
+    memcpy(cpus, sorted, sizeof(int) * num);
+    mu_free(nodes);
+    mu_free(sorted);
+}
+
+int affinity_bind_cpu(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0)  {
+        debug_msg("bind thread to cpu %d failed, file: %s, line: %d", cpu, __FILE__, __LINE__);
+        return -1;
+    }
+    return 0;
+}
+
+int affinity_bind_node(int node)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    int n = cpu_online_num();
+    int cpu;
+    for (cpu = 0; cpu < n && cpu < CPU_SETSIZE; cpu++)  {
+        if (node_has_cpu(node, cpu) == 1)  {
+            CPU_SET(cpu, &set);
+        }
+    }
+    if (CPU_COUNT(&set) == 0)  {
+        return -1;
+    }
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0)  {
+        debug_msg("bind thread to node %d failed, file: %s, line: %d", node, __FILE__, __LINE__);
+        return -1;
+    }
+    return 0;
+}
+
+/* 绑核之后调用，之后本线程首次访问的内存都从本节点分配，即使进程是以交错策略启动的 */
+void affinity_local_memory()
+{
+    syscall(SYS_set_mempolicy, MPOL_LOCAL_, NULL, 0);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+/* 工作线程绑核及NUMA节点相关 */
+
+int cpu_online_num();
+
+int cpu_list_parse(const char* str, int* cpus, int max);
+
+int cpu_numa_node(int cpu);
+
+void cpu_list_spread_nodes(int* cpus, int num);
+
+int affinity_bind_cpu(int cpu);
+int affinity_bind_node(int node);
+
+void affinity_local_memory();
@@ -0,0 +1,322 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "allocator.h"
+#include "hugepage.h"
+#include "config.h"
+
+#include "misc/logger.h"
+
+/* 每块内存前面16字节的头，释放时按它记账、找回底层的地址 */
+typedef struct mem_header_t  {
+    size_t   size;
+    uint16_t tag;
+    uint16_t offset;       //头到底层内存起点的距离，对齐分配时不为0
+    int32_t  cls;          //底层分配器给的大小类别
+} mem_header;
+
+/* 每个线程一份计数，只有本线程写，不用加锁的读改写；块在线程第一次用到时登记到链表上，之后不释放，
+   线程退出后它的计数仍算在总数里。别的线程分配的块记在释放它的线程上，单个线程的live_bytes可能是负的 */
+typedef struct mem_stat_block_t  {
+    mem_stat stats[MEM_TAG_NUM];
+    struct mem_stat_block_t* next;
+} mem_stat_block;
+
+static mem_stat_block* mem_stat_blocks;      //所有登记过的线程，只在头部插入
+static mem_stat_block mem_stat_spare;        //登记失败的线程共用，计数可能丢掉一些
+static __thread mem_stat_block* thread_stats;
+static long mem_last_allocs[MEM_TAG_NUM];  //上次打印时的allocs，只在打印的线程使用
+
+static const char* mem_tag_names[MEM_TAG_NUM] = { "misc", "loop", "conn", "event", "buffer", "timer", "dict" };
+
+
+static void* libc_alloc(size_t size, int* cls)
+{
+    *cls = -1;
+    return malloc(size);
+}
+
+static void libc_free(void* ptr, int cls)
+{
+    free(ptr);
+}
+
+static const mem_allocator libc_allocator = { "libc", libc_alloc, libc_free };
+
+
+/* 每个线程的缓存：MEM_ARENA_MIN到MEM_ARENA_MAX之间按2的幂分类，释放的块挂在本线程的链表上，
+   别的线程分配的块在哪个线程释放就归哪个线程；更大的块和超出上限的直接交给libc */
+#define MEM_ARENA_MIN_SHIFT 5
+#define MEM_ARENA_CLASSES   9          //32字节到8KB
+
+typedef struct mem_arena_t  {
+    void* free[MEM_ARENA_CLASSES];
+    int   free_num[MEM_ARENA_CLASSES];
+} mem_arena;
+
+static __thread mem_arena thread_arena;
+
+static int mem_arena_class(size_t size)
+{
+    int c = 0;
+    while (c < MEM_ARENA_CLASSES && ((size_t)1 << (c + MEM_ARENA_MIN_SHIFT)) < size)  {
+        c++;
+    }
+    return c;
+}
+
+static void* arena_alloc(size_t size, int* cls)
+{
+    int c = mem_arena_class(size);
+    if (c == MEM_ARENA_CLASSES)  {
+        *cls = -1;
+        return malloc(size);
+    }
+    *cls = c;
+    mem_arena* a = &thread_arena;
+    void* ptr = a->free[c];
+    if (ptr)  {
+        a->free[c] = *(void**)ptr;
+        a->free_num[c]--;
+        return ptr;
+    }
+    return malloc((size_t)1 << (c + MEM_ARENA_MIN_SHIFT));
+}
+
+static void arena_free(void* ptr, int cls)
+{
+    mem_arena* a = &thread_arena;
+    if (cls < 0 || cls >= MEM_ARENA_CLASSES
+        || ((long)a->free_num[cls] << (cls + MEM_ARENA_MIN_SHIFT)) >= MEM_ARENA_CLASS_BYTES)  {
+        free(ptr);
+        return;
+    }
+    *(void**)ptr = a->free[cls];
+    a->free[cls] = ptr;
+    a->free_num[cls]++;
+}
+
+static const mem_allocator arena_allocator = { "arena", arena_alloc, arena_free };
+
+
+/* 和arena一样按大小分类缓存，但新的小块从本线程的2MB大页区域中依次切出，小对象集中在少数大页上；
+   区域中的块不能交给libc，释放后只挂在释放线程的链表上，区域不归还，所以每个线程最多映射MEM_HUGEPAGE_REGIONS个，
+   之后的分配走arena，超出缓存上限的照样还给libc */
+#define MEM_CLS_REGION 0x100      //cls中的标志，块是从区域中切出的
+
+typedef struct mem_region_t  {
+    char* pos;
+    size_t left;
+    int regions;                  //本线程映射过的区域数
+    void* free[MEM_ARENA_CLASSES];
+} mem_region;
+
+static __thread mem_region thread_region;
+
+static void* hugepage_alloc(size_t size, int* cls)
+{
+    int c = mem_arena_class(size);
+    if (c == MEM_ARENA_CLASSES)  {
+        *cls = -1;
+        return malloc(size);
+    }
+    mem_region* r = &thread_region;
+    void* ptr = r->free[c];
+    if (ptr)  {
+        r->free[c] = *(void**)ptr;
+        *cls = c | MEM_CLS_REGION;
+        return ptr;
+    }
+    size_t bytes = (size_t)1 << (c + MEM_ARENA_MIN_SHIFT);
+    if (r->left < bytes && r->regions < MEM_HUGEPAGE_REGIONS)  {       //剩下的一点不要了
+        int huge;
+        char* region = (char*)hugepage_map(HUGEPAGE_SIZE, &huge);
+        if (region)  {
+            r->pos = region;
+            r->left = HUGEPAGE_SIZE;
+            r->regions++;
+        }
+    }
+    if (r->left < bytes)  {       //区域用完了或者映射失败
+        return arena_alloc(size, cls);
+    }
+    ptr = r->pos;
+    r->pos += bytes;
+    r->left -= bytes;
+    *cls = c | MEM_CLS_REGION;
+    return ptr;
+}
+
+/* 区域中的块同一类别的大小相同，挂到本线程的链表上复用；其他的块按arena的规则处理 */
+static void hugepage_free(void* ptr, int cls)
+{
+    if (cls < 0 || !(cls & MEM_CLS_REGION))  {
+        arena_free(ptr, cls);
+        return;
+    }
+    mem_region* r = &thread_region;
+    cls &= ~MEM_CLS_REGION;
+    *(void**)ptr = r->free[cls];
+    r->free[cls] = ptr;
+}
+
+static const mem_allocator hugepage_allocator = { "hugepage", hugepage_alloc, hugepage_free };
+
+
+static const mem_allocator* allocator = &libc_allocator;
+
+/* 在启动线程之前调用，只切换一次；之前分配的块仍然可以释放，free时按块记下的类别处理 */
+void mem_set_allocator(const mem_allocator* a)
+{
+    allocator = a;
+}
+
+int mem_use_allocator(int type)
+{
+    if (type == MEM_ALLOC_LIBC)  {
+        mem_set_allocator(&libc_allocator);
+    }
+    else if (type == MEM_ALLOC_ARENA)  {
+        mem_set_allocator(&arena_allocator);
+    }
+    else if (type == MEM_ALLOC_HUGEPAGE)  {
+        mem_set_allocator(&hugepage_allocator);
+    }
+    else  {
+        return -1;
+    }
+    return 0;
+}
+
+int mem_allocator_from_name(const char* name)
+{
+    if (strcmp(name, "libc") == 0)  {
+        return MEM_ALLOC_LIBC;
+    }
+    else if (strcmp(name, "arena") == 0)  {
+        return MEM_ALLOC_ARENA;
+    }
+    else if (strcmp(name, "hugepage") == 0)  {
+        return MEM_ALLOC_HUGEPAGE;
+    }
+    return -1;
+}
+
+const char* mem_allocator_name()
+{
+    return allocator->name;
+}
+
+
+static mem_stat* mem_thread_stats()
+{
+    mem_stat_block* b = thread_stats;
+    if (b == NULL)  {
+        b = (mem_stat_block*)calloc(1, sizeof(mem_stat_block));     //不能经过mem_alloc，它要用这里的计数
+        if (b == NULL)  {
+            b = &mem_stat_spare;
+        }
+        else  {
+            b->next = __atomic_load_n(&mem_stat_blocks, __ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(&mem_stat_blocks, &b->next, b, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))  {
+            }
+        }
+        thread_stats = b;
+    }
+    return b->stats;
+}
+
+/* 打印的线程同时在读，写要原子，但不用lock前缀的读改写 */
+static void mem_stat_add(long* counter, long n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+void mem_account(int tag, long bytes)
+{
+    mem_stat_add(&mem_thread_stats()[tag].live_bytes, bytes);
+}
+
+/* align是2的幂，不超过页大小 */
+void* mem_alloc_aligned(int tag, size_t align, size_t size)
+{
+    if (align < 16)  {
+        align = 16;
+    }
+    size_t extra = sizeof(mem_header) + (align > 16 ? align - 16 : 0);
+    int cls;
+    char* base = (char*)allocator->alloc(size + extra, &cls);
+    if (base == NULL)  {
+        return NULL;
+    }
+    char* ptr = (char*)(((uintptr_t)base + sizeof(mem_header) + align - 1) & ~(uintptr_t)(align - 1));
+    mem_header* h = (mem_header*)ptr - 1;
+    h->size = size;
+    h->tag = tag;
+    h->offset = (char*)h - base;
+    h->cls = cls;
+
+    mem_stat* st = mem_thread_stats() + tag;
+    mem_stat_add(&st->live_bytes, size);
+    mem_stat_add(&st->allocs, 1);
+    return ptr;
+}
+
+void* mem_alloc(int tag, size_t size)
+{
+    return mem_alloc_aligned(tag, 16, size);
+}
+
+void mem_free(void* ptr)
+{
+    if (ptr == NULL)  {
+        return;
+    }
+    mem_header* h = (mem_header*)ptr - 1;
+    mem_stat* st = mem_thread_stats() + h->tag;
+    mem_stat_add(&st->live_bytes, -(long)h->size);
+    mem_stat_add(&st->frees, 1);
+    allocator->free((char*)h - h->offset, h->cls);
+}
+
+
+static void mem_stat_sum(mem_stat_block* b, int tag, mem_stat* st)
+{
+    st->live_bytes += __atomic_load_n(&b->stats[tag].live_bytes, __ATOMIC_RELAXED);
+    st->allocs += __atomic_load_n(&b->stats[tag].allocs, __ATOMIC_RELAXED);
+    st->frees += __atomic_load_n(&b->stats[tag].frees, __ATOMIC_RELAXED);
+}
+
+/* 所有线程的计数加起来，各线程还在更新，总数只是近似的 */
+void mem_get_stat(int tag, mem_stat* st)
+{
+    memset(st, 0, sizeof(mem_stat));
+    mem_stat_block* b;
+    for (b = __atomic_load_n(&mem_stat_blocks, __ATOMIC_ACQUIRE); b; b = b->next)  {
+        mem_stat_sum(b, tag, st);
+    }
+    mem_stat_sum(&mem_stat_spare, tag, st);
+}
+
+/* 每个标签的在用内存和上次打印以来的每秒分配次数 */
+void mem_stats_log(int interval_ms)
+{
+    char line[512];
+    int len = 0;
+    int tag;
+    for (tag = 0; tag < MEM_TAG_NUM && len < (int)sizeof(line); tag++)  {
+        mem_stat st;
+        mem_get_stat(tag, &st);
+        long rate = interval_ms > 0 ? (st.allocs - mem_last_allocs[tag]) * 1000 / interval_ms : 0;
+        mem_last_allocs[tag] = st.allocs;
+        len += snprintf(line + len, sizeof(line) - len, " %s %ldKB %ld/s",
+                        mem_tag_names[tag], st.live_bytes / 1024, rate);
+    }
+    debug_msg("mem (%s):%s", allocator->name, line);
+
+    hugepage_stat hs;
+    hugepage_get_stat(&hs);
+    debug_msg("hugepages: %ld hugetlb, %ld thp regions, AnonHugePages %ldkB",
+              hs.hugetlb_pages, hs.thp_pages, hs.anon_huge_kb);
+}
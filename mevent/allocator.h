@@ -0,0 +1,48 @@
+#pragma once
+#include <stddef.h>
+
+/* 所有动态内存都经过这里：按子系统打标签记账，底层的分配器在启动时选择 */
+
+enum MemTag  {
+    MEM_TAG_MISC,          //server_manager、cpu列表等启动时分配一次的
+    MEM_TAG_LOOP,          //event_loop本身、epoll事件数组、io_uring、接收缓冲区
+    MEM_TAG_CONN,          //连接块(含event和http的request)、listener、accept批次
+    MEM_TAG_EVENT,         //不属于连接的event：listener、eventfd
+    MEM_TAG_BUFFER,        //读写缓冲区，包括映射的读缓冲区
+    MEM_TAG_TIMER,
+    MEM_TAG_DICT,
+    MEM_TAG_NUM
+};
+
+enum MemAllocatorType  {
+    MEM_ALLOC_LIBC,        //直接malloc/free
+    MEM_ALLOC_ARENA,       //每个线程按大小缓存释放的小块，loop线程上的分配和释放不再进libc
+    MEM_ALLOC_HUGEPAGE,    //同arena，新的小块从每个线程的2MB大页区域中切出
+};
+
+/* 底层分配器，alloc返回至少size字节、16字节对齐的内存，并给出大小类别，free时原样传回 */
+typedef struct mem_allocator_t  {
+    const char* name;
+    void* (*alloc)(size_t size, int* cls);
+    void  (*free)(void* ptr, int cls);
+} mem_allocator;
+
+typedef struct mem_stat_t  {
+    long live_bytes;       //还没释放的字节数，不含每块16字节的头
+    long allocs;           //累计分配次数
+    long frees;
+} mem_stat;
+
+
+void mem_set_allocator(const mem_allocator* a);
+int  mem_use_allocator(int type);
+int  mem_allocator_from_name(const char* name);
+const char* mem_allocator_name();
+
+void* mem_alloc(int tag, size_t size);
+void* mem_alloc_aligned(int tag, size_t align, size_t size);
+void  mem_free(void* ptr);
+
+void mem_account(int tag, long bytes);
+void mem_get_stat(int tag, mem_stat* st);
+void mem_stats_log(int interval_ms);
@@ -0,0 +1,376 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "buffer_chain.h"
+#include "hugepage.h"
+#include "config.h"
+
+#ifndef IOV_MAX
+    #define IOV_MAX 1024       //Linux的UIO_MAXIOV
+#endif
+
+buffer_pool* buffer_pool_create()
+{
+    buffer_pool* pool = (buffer_pool*)mu_malloc(MEM_TAG_BUFFER, sizeof(buffer_pool));
+    if (pool)  {
+        memset(pool, 0, sizeof(buffer_pool));
+    }
+    return pool;
+}
+
+#define BUFFER_REGION_NODES ((int)(HUGEPAGE_SIZE / BUFFER_CHUNK_SIZE))
+
+/* 区域的第一个节点放区域头，其余的节点按BUFFER_CHUNK_SIZE对齐，节点地址向下对齐到HUGEPAGE_SIZE就是区域头 */
+struct buffer_region_t  {
+    buffer_region* prev;
+    buffer_region* next;
+    void* free_nodes;            //还回来的节点
+    int bump;                    //从没用过的第一个节点
+    int used;
+    int huge;
+};
+
+static int buffer_region_has_space(buffer_region* r)
+{
+    return r->free_nodes || r->bump < BUFFER_REGION_NODES;
+}
+
+static buffer_region* buffer_region_create(buffer_pool* pool)
+{
+    int huge = 0;
+    buffer_region* r = (buffer_region*)hugepage_map(HUGEPAGE_SIZE, &huge);
+    if (r == NULL)  {
+        return NULL;
+    }
+    r->prev = NULL;
+    r->next = pool->regions;
+    if (pool->regions)  {
+        pool->regions->prev = r;
+    }
+    pool->regions = r;
+    r->free_nodes = NULL;
+    r->bump = 1;
+    r->used = 0;
+    r->huge = huge;
+    mem_account(MEM_TAG_BUFFER, HUGEPAGE_SIZE);
+    pool->region_num++;
+    pool->huge_regions += huge;
+    return r;
+}
+
+static void buffer_region_destroy(buffer_pool* pool, buffer_region* r)
+{
+    if (r->prev)  {
+        r->prev->next = r->next;
+    }
+    else  {
+        pool->regions = r->next;
+    }
+    if (r->next)  {
+        r->next->prev = r->prev;
+    }
+    if (pool->current == r)  {
+        pool->current = NULL;
+    }
+    pool->region_num--;
+    pool->huge_regions -= r->huge;
+    hugepage_unmap(r, HUGEPAGE_SIZE, r->huge);
+    mem_account(MEM_TAG_BUFFER, -(long)HUGEPAGE_SIZE);
+}
+
+static char* buffer_node_alloc(buffer_pool* pool)
+{
+    buffer_region* r = pool->current;
+    if (r == NULL || !buffer_region_has_space(r))  {
+        for (r = pool->regions; r && !buffer_region_has_space(r); r = r->next)  {
+        }
+        if (r == NULL && (r = buffer_region_create(pool)) == NULL)  {
+            return NULL;
+        }
+        pool->current = r;
+    }
+    char* node = (char*)r->free_nodes;
+    if (node)  {
+        r->free_nodes = *(void**)node;
+    }
+    else  {
+        node = (char*)r + (size_t)r->bump++ * BUFFER_CHUNK_SIZE;
+    }
+    r->used++;
+    pool->node_used++;
+    return node;
+}
+
+static void buffer_node_free(buffer_pool* pool, char* node)
+{
+    buffer_region* r = (buffer_region*)((uintptr_t)node & ~(uintptr_t)(HUGEPAGE_SIZE - 1));
+    *(void**)node = r->free_nodes;
+    r->free_nodes = node;
+    r->used--;
+    pool->node_used--;
+    if (r->used == 0 && r != pool->current)  {      //整个区域都空了，还给系统
+        buffer_region_destroy(pool, r);
+    }
+}
+
+static void buffer_chunk_destroy(buffer_pool* pool, buffer_chunk* chunk)
+{
+    buffer_node_free(pool, chunk->data);
+    mu_free(chunk);
+}
+
+static buffer_chunk* buffer_chunk_list_trim(buffer_pool* pool, buffer_chunk* chunk, int n)
+{
+    while (chunk && n-- > 0)  {
+        buffer_chunk* next = chunk->next;
+        buffer_chunk_destroy(pool, chunk);
+        chunk = next;
+    }
+    return chunk;
+}
+
+void buffer_pool_free(buffer_pool* pool)
+{
+    if (pool)  {
+        buffer_chunk_list_trim(pool, pool->chunks, pool->chunk_num);
+        while (pool->regions)  {
+            buffer_region_destroy(pool, pool->regions);
+        }
+        mu_free(pool);
+    }
+}
+
+/* 定时调用，上个周期里一直空闲的块释放掉 */
+void buffer_pool_shrink(buffer_pool* pool)
+{
+    pool->chunks = buffer_chunk_list_trim(pool, pool->chunks, pool->chunk_low);
+    pool->chunk_num -= pool->chunk_low;
+    pool->chunk_low = pool->chunk_num;
+    if (pool->current && pool->current->used == 0 && pool->region_num > 1)  {
+        buffer_region_destroy(pool, pool->current);
+    }
+}
+
+static buffer_chunk* buffer_pool_get(buffer_pool* pool)
+{
+    buffer_chunk* chunk = pool->chunks;
+    if (chunk)  {
+        pool->chunks = chunk->next;
+        if (--pool->chunk_num < pool->chunk_low)  {
+            pool->chunk_low = pool->chunk_num;
+        }
+    }
+    else  {
+        chunk = (buffer_chunk*)mu_malloc(MEM_TAG_BUFFER, sizeof(buffer_chunk));
+        if (chunk == NULL)  {
+            return NULL;
+        }
+        chunk->data = buffer_node_alloc(pool);
+        if (chunk->data == NULL)  {
+            mu_free(chunk);
+            return NULL;
+        }
+    }
+    chunk->next = NULL;
+    chunk->start = chunk->end = 0;
+    chunk->cap = BUFFER_CHUNK_SIZE;
+    return chunk;
+}
+
+static void buffer_pool_put(buffer_pool* pool, buffer_chunk* chunk)
+{
+    if (pool->chunk_num < BUFFER_POOL_MAX)  {
+        chunk->next = pool->chunks;
+        pool->chunks = chunk;
+        pool->chunk_num++;
+    }
+    else  {
+        buffer_chunk_destroy(pool, chunk);
+    }
+}
+
+
+void buffer_chain_init(buffer_chain* c, buffer_pool* pool)
+{
+    c->head = c->tail = NULL;
+    c->bytes = 0;
+    c->pool = pool;
+}
+
+void buffer_chain_clear(buffer_chain* c)
+{
+    buffer_chunk* chunk = c->head;
+    while (chunk)  {
+        buffer_chunk* next = chunk->next;
+        buffer_pool_put(c->pool, chunk);
+        chunk = next;
+    }
+    c->head = c->tail = NULL;
+    c->bytes = 0;
+}
+
+static void buffer_chain_link(buffer_chain* c, buffer_chunk* chunk)
+{
+    if (c->tail)  {
+        c->tail->next = chunk;
+    }
+    else  {
+        c->head = chunk;
+    }
+    c->tail = chunk;
+}
+
+/* 尾部自有块剩下的空间，不够时接一个新块 */
+static buffer_chunk* buffer_chain_writable(buffer_chain* c)
+{
+    buffer_chunk* tail = c->tail;
+    if (tail && tail->cap > tail->end)  {
+        return tail;
+    }
+    buffer_chunk* chunk = buffer_pool_get(c->pool);
+    if (chunk)  {
+        buffer_chain_link(c, chunk);
+    }
+    return chunk;
+}
+
+/* 拿不到新块时返回-1，前面的部分已经追加进去了，调用者只能放弃整个连接 */
+int buffer_chain_append(buffer_chain* c, const char* data, int size)
+{
+    while (size > 0)  {
+        buffer_chunk* chunk = buffer_chain_writable(c);
+        if (chunk == NULL)  {
+            return -1;
+        }
+        int n = chunk->cap - chunk->end;
+        if (n > size)  {
+            n = size;
+        }
+        memcpy(chunk->data + chunk->end, data, n);
+        chunk->end += n;
+        c->bytes += n;
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/* 直接格式化到尾部块中，放不下时换一个新块再来一次；失败返回-1，这时可能已经追加了一部分 */
+int buffer_chain_printf(buffer_chain* c, const char* fmt, ...)
+{
+    va_list ap;
+    buffer_chunk* chunk = buffer_chain_writable(c);
+    if (chunk == NULL)  {
+        return -1;
+    }
+    int avail = chunk->cap - chunk->end;
+    va_start(ap, fmt);
+    int n = vsnprintf(chunk->data + chunk->end, avail, fmt, ap);
+    va_end(ap);
+    if (n < 0)  {
+        return -1;
+    }
+    if (n < avail)  {
+        chunk->end += n;
+        c->bytes += n;
+        return 0;
+    }
+
+    char* tmp = (char*)mu_malloc(MEM_TAG_BUFFER, n + 1);
+    if (tmp == NULL)  {
+        return -1;
+    }
+    va_start(ap, fmt);
+    vsnprintf(tmp, n + 1, fmt, ap);
+    va_end(ap);
+    int ret = buffer_chain_append(c, tmp, n);
+    mu_free(tmp);
+    return ret;
+}
+
+
+int buffer_chain_bytes(buffer_chain* c)
+{
+    return c->bytes;
+}
+
+/* 从头开始最多填max个iovec，返回填了几个 */
+int buffer_chain_fill_iovec(buffer_chain* c, struct iovec* iov, int max)
+{
+    int n = 0;
+    buffer_chunk* chunk = c->head;
+    while (chunk && n < max)  {
+        if (chunk->end > chunk->start)  {
+            iov[n].iov_base = chunk->data + chunk->start;
+            iov[n].iov_len = chunk->end - chunk->start;
+            n++;
+        }
+        chunk = chunk->next;
+    }
+    return n;
+}
+
+/* 发送了size字节，发完的块还给pool */
+void buffer_chain_consume(buffer_chain* c, int size)
+{
+    if (size > c->bytes)  {
+        size = c->bytes;
+    }
+    c->bytes -= size;
+    while (c->head)  {
+        buffer_chunk* chunk = c->head;
+        int n = chunk->end - chunk->start;
+        if (n > size)  {
+            chunk->start += size;
+            break;
+        }
+        size -= n;
+        c->head = chunk->next;
+        if (c->head == NULL)  {
+            c->tail = NULL;
+        }
+        buffer_pool_put(c->pool, chunk);
+    }
+}
+
+/* 从fd读最多size字节直接放进块里，返回读到的字节数 */
+int buffer_chain_read_fd(buffer_chain* c, int fd, int size)
+{
+    int total = 0;
+    while (total < size)  {
+        buffer_chunk* chunk = buffer_chain_writable(c);
+        if (chunk == NULL)  {
+            break;
+        }
+        int want = chunk->cap - chunk->end;
+        if (want > size - total)  {
+            want = size - total;
+        }
+        ssize_t n = read(fd, chunk->data + chunk->end, want);
+        if (n <= 0)  {
+            break;
+        }
+        chunk->end += n;
+        c->bytes += n;
+        total += n;
+    }
+    return total;
+}
+
+/* 一次writev发出尽量多的数据，返回发出的字节数，出错返回-1，errno由writev设置 */
+int buffer_chain_writev(buffer_chain* c, int fd)
+{
+    struct iovec iov[IOV_MAX];
+    int cnt = buffer_chain_fill_iovec(c, iov, IOV_MAX);
+    if (cnt == 0)  {
+        return 0;
+    }
+    ssize_t n = writev(fd, iov, cnt);
+    if (n > 0)  {
+        buffer_chain_consume(c, n);
+    }
+    return n;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <sys/uio.h>
+
+/* 写缓冲区：固定大小的块串成链表，块从所属loop的buffer_pool中取，发送时整条链一次writev，不用拼到一块连续内存里 */
+
+typedef struct buffer_chunk_t buffer_chunk;
+typedef struct buffer_pool_t  buffer_pool;
+typedef struct buffer_chain_t buffer_chain;
+typedef struct buffer_region_t buffer_region;
+
+struct buffer_chunk_t  {
+    buffer_chunk* next;
+    char* data;                  //指向从pool的大页区域中切出的节点
+    int start;                   //已发送到这里
+    int end;
+    int cap;
+};
+
+/* 只在一个loop线程中使用，不加锁；块的数据来自2MB的大页区域，按BUFFER_CHUNK_SIZE对齐切开 */
+struct buffer_pool_t  {
+    buffer_chunk* chunks;        //空闲的数据块
+    int chunk_num;
+    int chunk_low;               //上次收缩以来chunk_num的最低值，这么多块一直没用上
+
+    buffer_region* regions;      //所有区域，节点全部还回来的区域直接释放
+    buffer_region* current;      //从这个区域切节点，用完了再找有空闲节点的区域
+    int region_num;
+    int huge_regions;            //其中MAP_HUGETLB映射的
+    int node_used;               //借出去的节点数，包括pool里空闲块占着的
+};
+
+struct buffer_chain_t  {
+    buffer_chunk* head;
+    buffer_chunk* tail;
+    int bytes;                   //还没发送的字节数
+    buffer_pool* pool;
+};
+
+
+buffer_pool* buffer_pool_create();
+void buffer_pool_free(buffer_pool* pool);
+void buffer_pool_shrink(buffer_pool* pool);
+
+void buffer_chain_init(buffer_chain* c, buffer_pool* pool);
+void buffer_chain_clear(buffer_chain* c);
+
+int buffer_chain_append(buffer_chain* c, const char* data, int size);
+int buffer_chain_printf(buffer_chain* c, const char* fmt, ...);
+
+int buffer_chain_bytes(buffer_chain* c);
+int buffer_chain_fill_iovec(buffer_chain* c, struct iovec* iov, int max);
+void buffer_chain_consume(buffer_chain* c, int size);
+int buffer_chain_writev(buffer_chain* c, int fd);
+int buffer_chain_read_fd(buffer_chain* c, int fd, int size);
@@ -19,15 +19,42 @@
 #endif 
 
 
-#define mu_malloc malloc
-#define mu_free   free
+#include "allocator.h"
 
-#define LARGE_PAGE_NODE 12   //buffer node 的对齐
+#define mu_malloc(tag, size) mem_alloc(tag, size)    //tag是enum MemTag，按子系统记账
+#define mu_free(ptr)         mem_free(ptr)
 
-#define MAX_EVENTS  32       //epoll_wait一次性监听最大的事件数量
+#define MEM_ARENA_CLASS_BYTES (1L << 20)   //arena分配器每个线程每种大小最多缓存的字节数
+#define MEM_HUGEPAGE_REGIONS  4           //hugepage分配器每个线程最多映射的2MB区域数，用完后和arena一样分配
 
-#define MAX_LOOP 4           //max thread
+#define LARGE_PAGE_NODE 12   //buffer node 的对齐，2的幂次，大页区域按1 << LARGE_PAGE_NODE切成节点
 
+#define CACHE_LINE_SIZE 64
+#define CONN_SLAB_MAX   1024      //每个loop最多缓存的空闲连接块数
 
+#define MAX_EVENTS  32       //epoll_wait事件数组的初始大小，也是缩小的下限
+#define MAX_EVENTS_LIMIT 4096     //事件数组最多增长到这么大，可以用epoller_set_max_events修改
+#define EVENTS_SHRINK_ROUNDS 256  //连续这么多次就绪数不到数组的1/4就把数组减半
 
-#define MAX_TIMER_EVENT 100 //最大定时器个数   
\ No newline at end of file
+#define URING_ENTRIES  1024       //io_uring提交队列的长度，完成队列是它的4倍
+#define URING_BUF_NUM  256        //每个loop给multishot recv提供的缓冲区个数，必须是2的幂
+#define URING_BUF_SIZE 8192       //每个提供的缓冲区大小
+
+#define EDGE_READ_BUDGET  16      //边沿触发时一个连接一轮最多读的次数，剩下的留到下一轮
+#define EDGE_WRITE_BUDGET 16      //边沿触发时一个连接一轮最多写的次数
+
+#define RECV_BUF_SIZE     65536   //每个loop共用的接收缓冲区，一次read最多读这么多
+#define RING_BUFFER_SIZE  16384   //读缓冲区第一次分配的大小，向上取整到页大小，满了翻倍
+#define RING_POOL_LIMIT   (64L << 20)    //每个loop的读缓冲区最多占这么多内存，超过后连接暂停读取，0表示不限
+#define POOL_SHRINK_INTERVAL 5000  //毫秒，每隔这么久把一直空闲的缓冲区还给系统
+#define BUFFER_CHUNK_SIZE (1 << LARGE_PAGE_NODE)    //写缓冲区链表中每个块的大小，从2MB的大页区域中按这个大小对齐切出
+#define BUFFER_POOL_MAX   256     //每个loop最多缓存的空闲块数，多出来的直接释放
+#define URING_SEND_IOV    64      //io_uring后端一次sendmsg最多带的块数
+#define FILE_WINDOW_SIZE  (16 * BUFFER_CHUNK_SIZE)  //io_uring后端发送文件时写缓冲区里最多预读这么多，每次发送完成再补上
+
+#define ACCEPT_BUDGET 64     //监听socket一次可读事件最多accept的连接数
+
+#define REBALANCE_MIN_LOAD 1000   //一个检查周期内最忙的loop至少处理这么多可读事件才考虑迁移连接
+
+
+#define TIMER_SLACK 4        //定时器到期时间向上取整的毫秒数，相近的定时器合并到一次唤醒
\ No newline at end of file
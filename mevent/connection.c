@@ -9,41 +9,116 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/uio.h>
+#include <sys/sendfile.h>
 #include "connection.h"
 #include "event_loop.h"
 #include "event.h"
 #include "config.h"
 #include "ring_buffer.h"
+#include "slab.h"
+#include "epoll.h"
 
 #include "misc/logger.h"
 
 
+#define READ_AGAIN (-2)
+
 static void connection_passive_close(connection* conn);
 static void connection_disconnect(connection* conn);
 static void event_readable_callback(int fd, event* ev, void* arg);
 static void event_writable_callback(int fd, event* ev, void* arg);
+static void connection_update_pending(connection* conn);
+static void connection_submit_send(connection* conn);
+static void connection_send_complete(connection* conn, int n);
+static void connection_link(connection* conn, event_loop* loop);
+static void connection_unlink(connection* conn);
+static void connection_touch(connection* conn);
+static void connection_arm_timers(connection* conn);
+static void connection_cancel_timers(connection* conn);
+static int connection_flush(connection* conn, int budget);
+static void connection_fill_file(connection* conn);
+static void connection_close_file(connection* conn);
+static void connection_resume_input(connection* conn);
+static void connection_park_reader(connection* conn);
+static void connection_unpark_reader(connection* conn);
+
+/* 一个连接用到的对象放在同一块内存里，从所属loop的conn_slab中取，不用每次accept都malloc几次：
+   connection、event、读缓冲区头，然后是上层的对象(http的request)，io_uring后端下最后是sendmsg用的msghdr和iovec；
+   块按cache line对齐，每个成员也从新的cache line开始，一次可读事件只碰connection、event的头一个line和读缓冲区头 */
+typedef struct conn_block_t  {
+    connection  conn;
+    event       ev __attribute__((aligned(CACHE_LINE_SIZE)));
+    ring_buffer rb __attribute__((aligned(CACHE_LINE_SIZE)));
+} conn_block;
+
+#define CONN_ALIGN(size) (((size) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE)
+
+static int conn_context_size = 0;
+
+/* 在创建连接之前调用，之后每个连接块里都带着这么大的上层对象 */
+void connection_set_context_size(int size)
+{
+    conn_context_size = size;
+}
+
+void* connection_context(connection* conn)
+{
+    return (char*)conn + CONN_ALIGN(sizeof(conn_block));
+}
+
+static size_t connection_block_size()
+{
+    size_t size = CONN_ALIGN(sizeof(conn_block)) + CONN_ALIGN(conn_context_size);
+    if (epoller_backend() == IO_BACKEND_URING)  {
+        size += sizeof(struct msghdr) + sizeof(struct iovec) * URING_SEND_IOV;
+    }
+    return size;
+}
+
+/* event的refs为0时才回收整块，回调和io_uring的操作返回之前连接的内存都还在 */
+static void connection_block_release(event* ev)
+{
+    connection* conn = (connection*)ev->r_arg;
+    slab_free(conn->loop->conn_slab, conn);
+}
 
 connection* connection_create(event_loop* loop, int connfd, message_callback_pt msg_cb)
 {
-    connection* conn = (connection* )mu_malloc(sizeof(connection));
-    if (conn == NULL)  {
+    if (loop->conn_slab == NULL)  {
+        loop->conn_slab = slab_create(connection_block_size(), CONN_SLAB_MAX);
+        if (loop->conn_slab == NULL)  {
+            return NULL;
+        }
+    }
+    conn_block* block = (conn_block*)slab_alloc(loop->conn_slab);
+    if (block == NULL)  {
         debug_ret("create connection failed, file: %s, line: %d", __FILE__, __LINE__);
         return NULL;
     }
 
+    connection* conn = &block->conn;
     memset(conn, 0, sizeof(connection));
     conn->connfd = connfd;
+    conn->loop = loop;
+    buffer_chain_init(&conn->write_chain, loop->chunk_pool);
     conn->message_callback = msg_cb;
+    conn->file_fd = -1;
 
-    event* ev = (event*)event_create(connfd,  EPOLLIN | EPOLLPRI, event_readable_callback, 
-                            conn, event_writable_callback, conn);
-    if (ev == NULL)  {
-        debug_ret("create event failed, file: %s, line: %d", __FILE__, __LINE__);
-        mu_free(conn);
-        return NULL;
+    ring_buffer_init(&block->rb, loop->read_pool);
+    conn->ring_buffer_read = &block->rb;
+
+    int flag = EPOLLIN | EPOLLPRI;
+    if (event_edge_triggered())  {        //边沿触发时一直监听EPOLLOUT，发送不完时不用再epoll_ctl
+        flag |= EPOLLOUT | EPOLLET;
     }
+    event* ev = &block->ev;
+    event_init(ev, connfd, flag, event_readable_callback, 
+               conn, event_writable_callback, conn);
+    ev->release = connection_block_release;
+    event_set_io(ev, EVENT_IO_RECV);         //io_uring后端下由内核收数据
 
     conn->conn_event = ev;
+    connection_link(conn, loop);
     
     return conn;    
 }
@@ -51,86 +126,152 @@ connection* connection_create(event_loop* loop, int connfd, message_callback_pt
 
 void connection_start(connection* conn, event_loop* loop)
 {
-    if (! conn->ring_buffer_read)  {
-        conn->ring_buffer_read = ring_buffer_new();
-    }
-
-    if (! conn->ring_buffer_write)  {
-        conn->ring_buffer_write = ring_buffer_new();
+    if (! conn->send_msg && conn->conn_event->io_type != EVENT_IO_POLL)  {
+        conn->send_msg = (struct msghdr*)((char*)connection_context(conn) + CONN_ALIGN(conn_context_size));
+        memset(conn->send_msg, 0, sizeof(struct msghdr));
+        conn->send_msg->msg_iov = (struct iovec*)(conn->send_msg + 1);
     }
-    event_add_io(loop->epoll_fd, conn->conn_event);
+    event_add_io(loop, conn->conn_event);
 }
 
 
-static int read_buffer(int fd, connection* conn)       //使用了readv但是好像并没有提高效率，不过使用了栈上数据，避免了malloc，free
+/* 没有积压的数据时直接读到loop共用的接收缓冲区，上层在原地解析；一个请求跨了多次读时才写到连接自己的缓冲区 */
+static int read_buffer(int fd, connection* conn)
 {
-    int nread2 = 65536;
-    char extrabuf2[nread2];
-    struct iovec vec[2];
-
-    char* start = ring_buffer_readable_start(conn->ring_buffer_read);
-    int available_bytes = ring_buffer_available_bytes(conn->ring_buffer_read);
-    vec[0].iov_base = start;
-    vec[0].iov_len = available_bytes;        //一开始时为0，并不读到ring_buffer中去
-    vec[1].iov_base = extrabuf2;
-    vec[1].iov_len = nread2;
+    ring_buffer* rb = conn->ring_buffer_read;
+    if (ring_buffer_readable_bytes(rb) == 0)  {
+        ring_buffer_borrow(rb, conn->loop->recv_buf, 0, RECV_BUF_SIZE);
+    }
+    else if (ring_buffer_reserve(rb) < 0)  {     //本loop的读缓冲区到了上限，数据先留在内核里，有内存还回来再读
+        connection_park_reader(conn);
+        return READ_AGAIN;
+    }
 
-    ssize_t nread = readv(fd, vec, 2);      //最多读iovec结构体指定的长度,而且fd一定是非阻塞的
+    ssize_t nread = read(fd, ring_buffer_writable_start(rb), ring_buffer_available_bytes(rb));      //fd一定是非阻塞的
     if (nread == 0)  {
         return 0;
     }
     else if (nread < 0)  {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)  {
-            return -1;
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)  {
+            return READ_AGAIN;
         }
         else  {
             debug_msg("read n < 0, fd : %d, file: %s, line: %d", conn->connfd, __FILE__, __LINE__);
             return -1;
         }
     }
-    else if (nread <= available_bytes)  {
-        conn->ring_buffer_read->end += nread;
-        return nread;
+    rb->end += nread;
+    return nread;
+}
+
+/* 已经决定关闭的连接只等写缓冲区发完，这期间收到的数据直接丢掉，不再交给上层 */
+static void connection_deliver(connection* conn)
+{
+    if (conn->state != 0)  {
+        ring_buffer_release_bytes(conn->ring_buffer_read, ring_buffer_readable_bytes(conn->ring_buffer_read));
+        return;
     }
-    else  {
-        conn->ring_buffer_read->end += available_bytes;
-        ring_buffer_push_data(conn->ring_buffer_read, extrabuf2, nread - available_bytes);
-        return nread;
+    if (conn->message_callback)  {
+        conn->message_callback(conn);
+    }
+}
+
+/* 回调返回后调用，借用的接收缓冲区要给别的连接用了，没解析完的数据复制出来 */
+static void connection_own_input(event* ev, connection* conn)
+{
+    if (!ev->freed)  {         //回调中连接已经释放了
+        ring_buffer_own(conn->ring_buffer_read);
     }
-    return -1;
 }
 
 
 static void event_readable_callback(int fd, event* ev, void* arg)
 {
     connection* conn = (connection*)arg;
-    int nread = read_buffer(fd, conn);
-    if (nread > 0 && conn->message_callback)  {
-        conn->message_callback(conn);
+    conn->read_count++;
+    connection_touch(conn);
+    __atomic_store_n(&conn->loop->read_count, conn->loop->read_count + 1, __ATOMIC_RELAXED);   //只有本线程写
+
+    if (ev->io_type == EVENT_IO_RECV)  {      //io_uring已经把数据收到了io_buf里，io_buf在回调返回后还给内核
+        if (ev->io_result > 0)  {
+            if (ring_buffer_readable_bytes(conn->ring_buffer_read) == 0)  {
+                ring_buffer_borrow(conn->ring_buffer_read, ev->io_buf, ev->io_result, ev->io_result);
+            }
+            else  {
+                ring_buffer_push_data(conn->ring_buffer_read, ev->io_buf, ev->io_result);
+            }
+            connection_deliver(conn);
+            connection_own_input(ev, conn);
+        }
+        else  {
+            connection_passive_close(conn);
+        }
+        return;
+    }
+
+    if (!(ev->event_flag & EPOLLET))  {
+        int nread = read_buffer(fd, conn);
+        if (nread > 0)  {
+            connection_deliver(conn);
+        }
+        else if (nread != READ_AGAIN && nread <= 0)  {
+            connection_passive_close(conn);
+        }
+        connection_own_input(ev, conn);
+        return;
+    }
+
+    int total = 0;
+    int nread = 0;
+    int budget = EDGE_READ_BUDGET;
+    while (budget-- > 0)  {                   //边沿触发要一直读到EAGAIN，否则不会再通知
+        nread = read_buffer(fd, conn);
+        if (nread <= 0)  {
+            break;
+        }
+        total += nread;
+    }
+
+    if (total == 0)  {
+        if (nread != READ_AGAIN)  {
+            connection_passive_close(conn);
+        }
+        connection_own_input(ev, conn);
+        return;
     }
-    else if(nread <= 0)  {
-        connection_passive_close(conn);
+    if (nread != READ_AGAIN)  {       //超出预算，或者读到了对方关闭，先处理已读到的数据，下一轮再接着读
+        event_defer(ev, EPOLLIN);
     }
+    connection_deliver(conn);
+    connection_own_input(ev, conn);
 }
 
 static void event_writable_callback(int fd, event* ev, void* arg)
 {
-    int len = 0;
     connection* conn = (connection*)arg;
-    char* msg = ring_buffer_get_msg(conn->ring_buffer_write, &len);
-    if (msg && len > 0)  {
-        int n = send(conn->connfd, msg, len, 0);
-        if (n > 0)  {
-            ring_buffer_release_bytes(conn->ring_buffer_write, n);
-            len = ring_buffer_readable_bytes(conn->ring_buffer_write);
-            if (len == 0)  {    //send all buf
-                event_disable_writing(conn->conn_event);
-                if (conn->state == State_Closing)  {
-                    connection_free(conn);    //如不关闭一直会触发
-                    conn->state = State_Closed;
-                }
-            }
+    if (ev->io_type == EVENT_IO_RECV)  {      //io_uring后端下是一次send完成了
+        connection_send_complete(conn, ev->io_result);
+        return;
+    }
+
+    int budget = (ev->event_flag & EPOLLET) ? EDGE_WRITE_BUDGET : 1;
+    int ret = connection_flush(conn, budget);
+    if (ret < 0)  {
+        return;
+    }
+    connection_touch(conn);
+
+    if (ret == 0)  {    //send all buf
+        event_disable_writing(conn->conn_event);
+        if (conn->state == State_Closing)  {
+            conn->state = State_Closed;
+            connection_free(conn);    //如不关闭一直会触发
+            return;
         }
+        connection_resume_input(conn);
+    }
+    else if (ret == 2 && (ev->event_flag & EPOLLET))  {
+        event_defer(ev, EPOLLOUT);
     }
 }
 
@@ -152,6 +293,21 @@ void connection_active_close(connection* conn)
     connection_disconnect(conn);
 }
 
+/* 响应没能完整放进写缓冲区或者发送出错，已经排队的数据可能断在半个头部上，不能再发出去，直接关闭；
+   io_uring正在发送的块还被内核引用着不能还回pool，关掉写方向让之后的发送失败，在connection_send_complete中丢掉 */
+void connection_abort(connection* conn)
+{
+    if (conn->sending)  {
+        shutdown(conn->connfd, SHUT_WR);
+    }
+    else  {
+        buffer_chain_clear(&conn->write_chain);
+        connection_close_file(conn);
+        connection_update_pending(conn);
+    }
+    connection_disconnect(conn);
+}
+
 void connection_set_disconnect_callback(connection* conn, connection_callback_pt cb)
 {
     conn->disconnected_cb = cb;
@@ -160,12 +316,20 @@ void connection_set_disconnect_callback(connection* conn, connection_callback_pt
 static void connection_disconnect(connection* conn)
 {
     conn->state = State_Closing;
-    if (ring_buffer_readable_bytes(conn->ring_buffer_write) > 0)   {     //收到对方关闭写的通知时，如果缓冲区还有数据要发送则等数据发送完毕后再关闭socket
-        event_enable_writing(conn->conn_event); 
+    if (conn->sending)  {          //等正在发送的完成后在connection_send_complete中关闭
+        return;
+    }
+    if (buffer_chain_bytes(&conn->write_chain) > 0 || conn->file_fd >= 0)   {     //收到对方关闭写的通知时，如果缓冲区还有数据要发送则等数据发送完毕后再关闭socket
+        if (conn->conn_event->io_type != EVENT_IO_POLL)  {
+            connection_submit_send(conn);
+        }
+        else  {
+            event_enable_writing(conn->conn_event); 
+        }
     }
     else  {
-        connection_free(conn);    //如不关闭一直会触发
         conn->state = State_Closed;
+        connection_free(conn);    //如不关闭一直会触发
     }
 }
 
@@ -175,38 +339,418 @@ void connection_free(connection* conn)
         conn->disconnected_cb(conn);
     }
 
-    event_free(conn->conn_event);
+    connection_cancel_timers(conn);
 
-    if (conn->ring_buffer_read)  {
-        ring_buffer_free(conn->ring_buffer_read);
+    connection_unlink(conn);
+    connection_unpark_reader(conn);
+    __atomic_sub_fetch(&conn->loop->pending_bytes, conn->pending_bytes, __ATOMIC_RELAXED);
+
+    ring_buffer_clear(conn->ring_buffer_read);
+    buffer_chain_clear(&conn->write_chain);
+    connection_close_file(conn);
+
+    event_free(conn->conn_event);      //整块内存在event真正释放时还给conn_slab，之后不能再访问conn
+}
+
+
+static void connection_idle_timeout(void* arg)
+{
+    connection* conn = (connection*)arg;
+    if (conn->state == State_Closing && !conn->sending)  {      //关闭前要发的数据对方一直不收，不再等了
+        conn->state = State_Closed;
+        connection_free(conn);
+        return;
     }
-    if (conn->ring_buffer_write)  {
-        ring_buffer_free(conn->ring_buffer_write);
+    event_loop_reset_timer(conn->loop, conn->idle_timer, conn->idle_timeout);     //等剩下的数据发完，再给一个周期
+    connection_active_close(conn);
+}
+
+static void connection_life_timeout(void* arg)
+{
+    connection* conn = (connection*)arg;
+    conn->life_timer = NULL;         //TIMER_OPT_ONCE，回调返回后句柄就失效了
+    conn->expired = 1;
+    if (conn->state == 0 && !conn->sending
+        && ring_buffer_readable_bytes(conn->ring_buffer_read) == 0
+        && buffer_chain_bytes(&conn->write_chain) == 0)  {     //两次请求之间直接关闭，否则等上层处理完这个请求
+        connection_active_close(conn);
     }
-    
-    mu_free(conn);
 }
 
+static void connection_touch(connection* conn)
+{
+    if (conn->idle_timer)  {
+        event_loop_reset_timer(conn->loop, conn->idle_timer, conn->idle_timeout);
+    }
+}
 
-int connection_send_buffer(connection *conn)
+static void connection_arm_timers(connection* conn)
 {
-    int len = 0;
-    char* msg = ring_buffer_get_msg(conn->ring_buffer_write, &len);
-    if (msg && len > 0)  {
-        int n = send(conn->connfd, msg, len, 0);
-        if (n == -1)  {
-            return -1;
-        }
-        if (n > 0)  {
-            ring_buffer_release_bytes(conn->ring_buffer_write, n);
+    if (conn->idle_timeout > 0)  {
+        conn->idle_timer = event_loop_add_timer(conn->loop, conn->idle_timeout, TIMER_OPT_ONCE, connection_idle_timeout, conn);
+    }
+    if (conn->life_deadline > 0 && !conn->expired)  {
+        int64_t left = conn->life_deadline - conn->loop->now_ms;
+        conn->life_timer = event_loop_add_timer(conn->loop, left > 0 ? (int)left : 0, TIMER_OPT_ONCE, connection_life_timeout, conn);
+    }
+}
+
+static void connection_cancel_timers(connection* conn)
+{
+    event_loop_cancel_timer(conn->loop, conn->idle_timer);
+    event_loop_cancel_timer(conn->loop, conn->life_timer);
+    conn->idle_timer = NULL;
+    conn->life_timer = NULL;
+}
+
+/* 在conn所属的loop线程调用，0表示不限制 */
+void connection_set_idle_timeout(connection* conn, int ms)
+{
+    conn->idle_timeout = ms > 0 ? ms : 0;
+    if (conn->idle_timer && conn->idle_timeout > 0)  {
+        event_loop_reset_timer(conn->loop, conn->idle_timer, conn->idle_timeout);
+    }
+    else if (conn->idle_timer)  {
+        event_loop_cancel_timer(conn->loop, conn->idle_timer);
+        conn->idle_timer = NULL;
+    }
+    else if (conn->idle_timeout > 0)  {
+        conn->idle_timer = event_loop_add_timer(conn->loop, conn->idle_timeout, TIMER_OPT_ONCE, connection_idle_timeout, conn);
+    }
+}
+
+void connection_set_lifetime(connection* conn, int ms)
+{
+    event_loop_cancel_timer(conn->loop, conn->life_timer);
+    conn->life_timer = NULL;
+    conn->life_deadline = ms > 0 ? conn->loop->now_ms + ms : 0;
+    if (ms > 0)  {
+        conn->life_timer = event_loop_add_timer(conn->loop, ms, TIMER_OPT_ONCE, connection_life_timeout, conn);
+    }
+}
+
+
+static void connection_update_pending(connection* conn)       //把写缓冲区积压的变化同步到loop的计数上
+{
+    int pending = buffer_chain_bytes(&conn->write_chain);
+    if (pending != conn->pending_bytes)  {
+        __atomic_add_fetch(&conn->loop->pending_bytes, pending - conn->pending_bytes, __ATOMIC_RELAXED);
+        conn->pending_bytes = pending;
+    }
+}
+
+/* io_uring后端：把写缓冲区链表前面的块交给内核，发送期间新的数据只会追加在后面，已提交的部分不会动 */
+static void connection_submit_send(connection* conn)
+{
+    if (conn->sending || buffer_chain_bytes(&conn->write_chain) == 0)  {
+        return;
+    }
+    struct msghdr* msg = conn->send_msg;
+    msg->msg_iovlen = buffer_chain_fill_iovec(&conn->write_chain, msg->msg_iov, URING_SEND_IOV);
+    conn->sending = 1;
+    event_submit_sendmsg(conn->conn_event, msg);
+}
+
+static void connection_send_complete(connection* conn, int n)
+{
+    conn->sending = 0;
+    if (n < 0)  {            //对方已经关闭，没发出去的数据都丢掉
+        buffer_chain_clear(&conn->write_chain);
+        connection_close_file(conn);
+        connection_update_pending(conn);
+        connection_disconnect(conn);
+        return;
+    }
+
+    buffer_chain_consume(&conn->write_chain, n);
+    connection_touch(conn);
+    connection_fill_file(conn);         //发出去多少就从文件补多少
+    connection_submit_send(conn);       //没有发完的和发送期间新加的
+    connection_update_pending(conn);
+
+    if (!conn->sending && conn->state == State_Closing)  {
+        conn->state = State_Closed;
+        connection_free(conn);
+    }
+    else if (!conn->sending)  {
+        connection_resume_input(conn);
+    }
+}
+
+/* epoll后端：先发写缓冲区，再从file_offset接着sendfile，每次writev或sendfile用掉一次budget；
+   返回0表示全部发出，1表示socket写满了要等可写，2表示budget用完还没发完，-1出错 */
+static int connection_flush(connection* conn, int budget)
+{
+    while (budget-- > 0)  {
+        int len = buffer_chain_bytes(&conn->write_chain);
+        if (len > 0)  {
+            int n = buffer_chain_writev(&conn->write_chain, conn->connfd);      //头部的各个片段一次发出
+            if (n < 0)  {
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+            }
+            connection_update_pending(conn);
             if (n < len)  {       //没有发完全
-                event_enable_writing(conn->conn_event);              //须开启才能发送
                 return 1;
             }
-            else  {
-                return 0;
-            }
+            continue;
+        }
+        if (conn->file_fd < 0)  {
+            return 0;
         }
+        off_t offset = conn->file_offset;
+        ssize_t n = sendfile(conn->connfd, conn->file_fd, &offset, conn->file_left);     //不移动文件自己的偏移
+        if (n < 0)  {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+        }
+        conn->file_offset = offset;
+        conn->file_left -= n;
+        if (conn->file_left <= 0 || n == 0)  {       //n为0是文件被截短了，没有更多可发的
+            connection_close_file(conn);
+        }
+    }
+    return buffer_chain_bytes(&conn->write_chain) > 0 || conn->file_fd >= 0 ? 2 : 0;
+}
+
+/* 返回0表示全部发出，1表示剩下的等可写时再发，-1出错 */
+int connection_send_buffer(connection *conn)
+{
+    if (conn->conn_event->io_type != EVENT_IO_POLL)  {     //io_uring后端，和本轮loop中的其他操作一起提交
+        connection_submit_send(conn);
+        return 0;
+    }
+
+    int ret = connection_flush(conn, EDGE_WRITE_BUDGET);
+    if (ret > 0)  {
+        event_enable_writing(conn->conn_event);              //须开启才能发送
+        return 1;
     }
-    return -1;
-}
\ No newline at end of file
+    return ret;
+}
+
+/* 文件排在写缓冲区现有数据的后面发送，连接接管fd，发完或者连接释放时关闭；epoll后端从可写回调里接着sendfile，
+   io_uring后端每次只把FILE_WINDOW_SIZE读进写缓冲区，发送完成时再补，慢的客户端不会让整个文件留在内存里。
+   文件发完之前不能再往写缓冲区追加数据，用connection_file_pending判断；返回0，出错返回-1 */
+int connection_send_file(connection *conn, int fd, int size)
+{
+    if (conn->file_fd >= 0)  {
+        debug_msg("a file is still being sent, fd : %d, file : %s, line : %d", conn->connfd, __FILE__, __LINE__);
+        close(fd);
+        return -1;
+    }
+    conn->file_fd = fd;
+    conn->file_offset = 0;
+    conn->file_left = size;
+    conn->resume_input = 1;
+    if (size <= 0)  {
+        connection_close_file(conn);
+    }
+
+    if (conn->conn_event->io_type != EVENT_IO_POLL)  {
+        connection_fill_file(conn);
+        connection_submit_send(conn);
+        connection_update_pending(conn);
+        return 0;
+    }
+    int ret = connection_send_buffer(conn);
+    if (ret == 0)  {            //已经全部发出，上层还在处理输入
+        conn->resume_input = 0;
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+int connection_file_pending(connection *conn)
+{
+    return conn->file_fd >= 0;
+}
+
+/* io_uring后端：写缓冲区里不到FILE_WINDOW_SIZE时从文件读到这么多，读完后关闭文件 */
+static void connection_fill_file(connection* conn)
+{
+    if (conn->file_fd < 0)  {
+        return;
+    }
+    int want = FILE_WINDOW_SIZE - buffer_chain_bytes(&conn->write_chain);
+    if (want <= 0)  {
+        return;
+    }
+    if (want > conn->file_left)  {
+        want = conn->file_left;
+    }
+    int n = buffer_chain_read_fd(&conn->write_chain, conn->file_fd, want);
+    conn->file_offset += n;
+    conn->file_left -= n;
+    if (conn->file_left <= 0 || n < want)  {        //读到文件尾或出错
+        connection_close_file(conn);
+    }
+}
+
+static void connection_close_file(connection* conn)
+{
+    if (conn->file_fd >= 0)  {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+        conn->file_left = 0;
+    }
+}
+
+/* 输出都发完了，上层因为等待输出没有处理的输入（比如流水线后面的请求）现在接着处理 */
+static void connection_resume_input(connection* conn)
+{
+    if (!conn->resume_input || conn->file_fd >= 0 || buffer_chain_bytes(&conn->write_chain) > 0)  {
+        return;
+    }
+    conn->resume_input = 0;
+    if (conn->state == 0 && ring_buffer_readable_bytes(conn->ring_buffer_read) > 0 && conn->message_callback)  {
+        conn->message_callback(conn);
+    }
+}
+
+/* 只把文件内容读进写缓冲区，不发送，和前后追加的数据一起由connection_send_buffer一次发出 */
+int connection_append_file(connection *conn, int fd, int size)
+{
+    int n = buffer_chain_read_fd(&conn->write_chain, fd, size);
+    connection_update_pending(conn);
+    return n;
+}
+
+
+static void connection_link(connection* conn, event_loop* loop)
+{
+    conn->loop = loop;
+    conn->prev = NULL;
+    conn->next = loop->conn_list;
+    if (loop->conn_list)  {
+        loop->conn_list->prev = conn;
+    }
+    loop->conn_list = conn;
+    __atomic_add_fetch(&loop->conn_num, 1, __ATOMIC_RELAXED);
+}
+
+static void connection_unlink(connection* conn)
+{
+    event_loop* loop = conn->loop;
+    if (conn->prev)  {
+        conn->prev->next = conn->next;
+    }
+    else  {
+        loop->conn_list = conn->next;
+    }
+    if (conn->next)  {
+        conn->next->prev = conn->prev;
+    }
+    conn->prev = conn->next = NULL;
+    __atomic_sub_fetch(&loop->conn_num, 1, __ATOMIC_RELAXED);
+}
+
+/* 读缓冲区借不到内存时关掉EPOLLIN挂起来，不然水平触发下每轮都会就绪，边沿触发下要一直推迟，都是空转 */
+static void connection_park_reader(connection* conn)
+{
+    if (conn->read_parked)  {
+        return;
+    }
+    event_loop* loop = conn->loop;
+    event_add_flag(conn->conn_event, EPOLLIN, 0);
+    conn->read_parked = 1;
+    conn->wait_prev = NULL;
+    conn->wait_next = loop->read_waiters;
+    if (loop->read_waiters)  {
+        loop->read_waiters->wait_prev = conn;
+    }
+    loop->read_waiters = conn;
+}
+
+static void connection_unpark_reader(connection* conn)
+{
+    if (!conn->read_parked)  {
+        return;
+    }
+    if (conn->wait_prev)  {
+        conn->wait_prev->wait_next = conn->wait_next;
+    }
+    else  {
+        conn->loop->read_waiters = conn->wait_next;
+    }
+    if (conn->wait_next)  {
+        conn->wait_next->wait_prev = conn->wait_prev;
+    }
+    conn->wait_prev = conn->wait_next = NULL;
+    conn->read_parked = 0;
+}
+
+/* loop在read_pool有内存还回来之后调用，挂起的连接都重新打开EPOLLIN，还是借不到的会再挂起来 */
+void connection_wake_readers(event_loop* loop)
+{
+    loop->read_pool->released = 0;
+    while (loop->read_waiters)  {
+        connection* conn = loop->read_waiters;
+        connection_unpark_reader(conn);
+        event_add_flag(conn->conn_event, EPOLLIN, 1);
+    }
+}
+
+/* 两次请求之间才能迁移：读写缓冲区都是空的，也没有在等待可写，这时socket里的数据还留在内核中 */
+static int connection_is_idle(connection* conn)
+{
+    return conn->state == 0
+        && conn->conn_event->is_working
+        && (!(conn->conn_event->event_flag & EPOLLOUT) || (conn->conn_event->event_flag & EPOLLET))
+        && ring_buffer_readable_bytes(conn->ring_buffer_read) == 0
+        && buffer_chain_bytes(&conn->write_chain) == 0
+        && conn->file_fd < 0
+        && !conn->read_parked;
+}
+
+static void connection_adopt(event_loop* loop, void* arg)       //in the new loop thread
+{
+    connection* conn = (connection*)arg;
+    connection_link(conn, loop);
+    conn->write_chain.pool = loop->chunk_pool;      //读写缓冲区都是空的，以后从新loop借
+    if (conn->ring_buffer_read)  {
+        conn->ring_buffer_read->pool = loop->read_pool;
+    }
+    __atomic_sub_fetch(&loop->pending_conns, 1, __ATOMIC_RELAXED);
+    connection_arm_timers(conn);
+    event_add_io(loop, conn->conn_event);    //加入epoll时会检查当前状态，迁移途中到达的数据马上会触发
+}
+
+/* 在conn所属的loop线程调用，把空闲的连接交给to，成功返回0 */
+int connection_migrate(connection* conn, event_loop* to)
+{
+    if (to == conn->loop || !connection_is_idle(conn)
+        || conn->conn_event->io_type != EVENT_IO_POLL)  {       //io_uring的操作挂在原loop的ring上，不迁移
+        return -1;
+    }
+
+    event_stop(conn->conn_event);
+    connection_cancel_timers(conn);      //定时器挂在原loop上，到新loop后再设置
+    connection_unlink(conn);
+    __atomic_add_fetch(&to->pending_conns, 1, __ATOMIC_RELAXED);
+
+    conn->loop = to;
+    conn->migrate_task.callback = connection_adopt;
+    conn->migrate_task.arg = conn;
+    event_loop_post(to, &conn->migrate_task);          //之后conn归to所有，这里不能再访问
+    return 0;
+}
+
+/* 在from的线程调用，按最近的繁忙程度挑选空闲连接迁到to，迁走的可读事件数不超过load，返回迁移的连接数 */
+int connection_migrate_busy(event_loop* from, event_loop* to, int load)
+{
+    int moved = 0;
+    int moved_load = 0;
+    connection* conn = from->conn_list;
+    while (conn && moved_load < load)  {
+        connection* next = conn->next;
+        int count = conn->read_count;
+        if (count > 0 && count <= load - moved_load && connection_migrate(conn, to) == 0)  {     //不能迁过头，否则两边会来回搬
+            moved++;
+            moved_load += count;
+        }
+        conn = next;
+    }
+
+    for (conn = from->conn_list; conn; conn = conn->next)  {     //留下的连接重新开始统计
+        conn->read_count = 0;
+    }
+    return moved;
+}
@@ -1,5 +1,7 @@
 
 #pragma once
+#include "event_loop.h"
+#include "buffer_chain.h"
 
 typedef struct connection_t connection;
 
@@ -19,21 +21,42 @@ enum {
     State_Closed = 2,
 };
 
+/* 按访问频率排列：第一个cache line是每次可读都要用的，第二个是发送路径用的，后面的只在建立、迁移、关闭时用到 */
 struct connection_t  {
     int connfd;
+    int state;
+    int    read_count;        //上次迁移扫描以来的可读事件数，用来挑选繁忙的连接
+    int    idle_timeout;
+    event_loop* loop;     //所属的loop，连接的所有操作都在这个loop的线程中进行
     event* conn_event;    //清理阶段和改变事件时用到
+    ring_buffer*   ring_buffer_read;
     message_callback_pt      message_callback;
+    void*  handler;           //上层的对象，在connection_context中
+    timer* idle_timer;        //没有读写超过idle_timeout毫秒就关闭连接
+
+    buffer_chain   write_chain;            //待发送的数据，块来自所属loop的chunk_pool
+    struct msghdr* send_msg;               //io_uring后端下提交给内核的链表前部，完成之前这部分不能改动
+    int            sending;                //有一个sendmsg已经提交还没完成
+    int pending_bytes;    //已计入loop->pending_bytes的写缓冲区字节数
+    int    expired;           //已超过存活时间，上层处理完当前请求后应关闭
+    int    file_fd;           //写缓冲区发完后接着发送的文件，-1表示没有，发完或连接释放时关闭
+    long   file_offset;       //文件下一个要发的位置
+    long   file_left;         //文件还没发（io_uring后端是还没读进写缓冲区）的字节数
+    int    resume_input;      //发文件期间上层停止处理输入，全部发完后再调一次message_callback
+
     connection_callback_pt   connected_cb;
     connection_callback_pt   disconnected_cb;
-
-    ring_buffer*   ring_buffer_read;
-    ring_buffer*   ring_buffer_write;
-
-    int state;
-
-    void*  handler;
     int    port;              //client port
     int    time_on_connect;   
+    timer* life_timer;        //连接存活时间的上限
+    int64_t life_deadline;    //loop->now_ms的时间，迁移到其他loop后按剩下的时间重新设置
+
+    connection* prev;         //所属loop的连接链表
+    connection* next;
+    connection* wait_prev;    //所属loop的read_waiters链表
+    connection* wait_next;
+    int    read_parked;       //在read_waiters中，EPOLLIN已关掉
+    loop_task migrate_task;   //迁移时投递给新loop的任务
 };
 
 
@@ -41,9 +64,23 @@ connection* connection_create(event_loop* loop, int fd, message_callback_pt msg_
 void connection_start(connection* conn, event_loop* loop);
 void connection_established(connection* conn);
 void connection_active_close(connection* conn);
+void connection_abort(connection* conn);
 void connection_free(connection* conn);
 
 int connection_send_buffer(connection *conn);
+int connection_send_file(connection *conn, int fd, int size);
+int connection_file_pending(connection *conn);
+int connection_append_file(connection *conn, int fd, int size);
 
 void connection_set_disconnect_callback(connection* conn, connection_callback_pt cb);
 
+void connection_set_context_size(int size);
+void* connection_context(connection* conn);
+
+void connection_set_idle_timeout(connection* conn, int ms);
+void connection_set_lifetime(connection* conn, int ms);
+
+int connection_migrate(connection* conn, event_loop* to);
+void connection_wake_readers(event_loop* loop);
+int connection_migrate_busy(event_loop* from, event_loop* to, int load);
+
@@ -1,4 +1,3 @@
-#include <sys/time.h>
 #include <sys/epoll.h>
 #include <errno.h>
 #include <unistd.h>
@@ -6,13 +5,43 @@
 #include <stdio.h>
 
 #include "epoll.h"
+#include "uring.h"
 #include "event.h"
+#include "event_loop.h"
 #include "config.h"
 
 #include "misc/logger.h"
 
+static int io_backend = IO_BACKEND_EPOLL;
+static int max_events = MAX_EVENTS_LIMIT;
+
+/* 在创建任何loop之前调用，内核不支持io_uring时退回epoll，返回实际使用的后端 */
+int epoller_set_backend(int backend)
+{
+    if (backend == IO_BACKEND_URING && !uring_supported())  {
+        debug_msg("io_uring is not supported by the kernel, use epoll instead");
+        backend = IO_BACKEND_EPOLL;
+    }
+    io_backend = backend;
+    return io_backend;
+}
+
+int epoller_backend()
+{
+    return io_backend;
+}
+
+/* 在创建任何loop之前调用，每个loop的事件数组最多增长到max */
+void epoller_set_max_events(int max)
+{
+    max_events = max < MAX_EVENTS ? MAX_EVENTS : max;
+}
+
 int epoller_create()
 {
+    if (io_backend == IO_BACKEND_URING)  {
+        return uring_create();
+    }
     int epoll_fd = epoll_create(1024);  //大于0就好
     if (epoll_fd == -1)  {
          debug_ret("create epoll failed, file : %s, line : %d", __FILE__, __LINE__);
@@ -21,13 +50,21 @@ int epoller_create()
     return epoll_fd;
 }
 
-void epoll_free(int fd)
+void epoller_free(int fd)
 {
+    if (io_backend == IO_BACKEND_URING)  {
+        uring_free(fd);
+        return;
+    }
     close(fd);
 }
 
 void epoller_add(int epoll_fd, event* e)
 {
+    if (io_backend == IO_BACKEND_URING)  {
+        uring_add(epoll_fd, e);
+        return;
+    }
     struct epoll_event ev;
     ev.events = e->event_flag;
     ev.data.ptr = e;
@@ -39,6 +76,10 @@ void epoller_add(int epoll_fd, event* e)
 
 void epoller_del(int epoll_fd, event* e)
 {
+    if (io_backend == IO_BACKEND_URING)  {
+        uring_del(epoll_fd, e);
+        return;
+    }
     struct epoll_event ev;
     ev.events = e->event_flag;
 
@@ -49,6 +90,10 @@ void epoller_del(int epoll_fd, event* e)
 
 void epoller_modify(int epoll_fd, event* e)
 {
+    if (io_backend == IO_BACKEND_URING)  {
+        uring_modify(epoll_fd, e);
+        return;
+    }
     struct epoll_event ev;
     ev.events = e->event_flag;
     ev.data.ptr = e;
@@ -59,10 +104,47 @@ void epoller_modify(int epoll_fd, event* e)
 }
 
 
-struct timeval epoller_dispatch(int epoll_fd, int timeout)
+/* 数组被填满说明还有就绪的事件要等下一次epoll_wait，加倍；长时间用不到1/4则减半 */
+static void epoller_resize_events(event_loop* loop, int nfds)
 {
-    struct epoll_event events[MAX_EVENTS];
-    int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+    int cap = loop->events_cap;
+    if (nfds == cap)  {
+        __atomic_store_n(&loop->events_full, loop->events_full + 1, __ATOMIC_RELAXED);     //只有本线程写
+        loop->events_low_rounds = 0;
+        if (cap < max_events)  {
+            cap = cap * 2 > max_events ? max_events : cap * 2;
+        }
+    }
+    else if (nfds <= cap / 4 && cap > MAX_EVENTS)  {
+        if (++loop->events_low_rounds >= EVENTS_SHRINK_ROUNDS)  {
+            loop->events_low_rounds = 0;
+            cap = cap / 2 < MAX_EVENTS ? MAX_EVENTS : cap / 2;
+        }
+    }
+    else  {
+        loop->events_low_rounds = 0;
+    }
+
+    if (cap != loop->events_cap)  {
+        struct epoll_event* events = (struct epoll_event*)mu_malloc(MEM_TAG_LOOP, sizeof(struct epoll_event) * cap);
+        if (events == NULL)  {
+            return;
+        }
+        mu_free(loop->events);
+        loop->events = events;
+        loop->events_cap = cap;
+    }
+}
+
+void epoller_dispatch(event_loop* loop, int timeout)
+{
+    if (io_backend == IO_BACKEND_URING)  {
+        uring_dispatch(loop, timeout);
+        return;
+    }
+    struct epoll_event* events = loop->events;
+    int nfds = epoll_wait(loop->epoll_fd, events, loop->events_cap, timeout);
+    loop->active_num = nfds > 0 ? nfds : 0;
 
     if (nfds == -1)  {
         if (errno != EINTR)  {
@@ -70,19 +152,16 @@ struct timeval epoller_dispatch(int epoll_fd, int timeout)
         }
     }
 
-    struct timeval now;
-    gettimeofday(&now, NULL);
+    event_loop_update_time(loop);
 
     int i;
     event* ev;
     for (i = 0; i < nfds; i++)  {
         ev = (event*)events[i].data.ptr;
-        ev->time = now;
         ev->active_event = events[i].events;
         event_handler(ev);
     }
-
-    struct timeval end;
-    gettimeofday(&end, NULL);
-    return end;
+    if (nfds >= 0)  {
+        epoller_resize_events(loop, nfds);
+    }
 }
\ No newline at end of file
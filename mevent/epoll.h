@@ -2,12 +2,24 @@
 
 
 typedef struct event_t event;
+typedef struct event_loop_t event_loop;
+
+/* 事件驱动的后端，启动时选定，所有loop都一样 */
+enum IoBackend  {
+    IO_BACKEND_EPOLL,
+    IO_BACKEND_URING,     //accept、recv、send由io_uring完成，见uring.c
+};
+
+int epoller_set_backend(int backend);
+int epoller_backend();
+
+void epoller_set_max_events(int max);
 
 int epoller_create();
-void epoller_free();
+void epoller_free(int fd);
 
 void epoller_add(int fd, event* ev);
 void epoller_del(int fd, event* ev);
 void epoller_modify(int fd, event* ev);
 
-struct timeval epoller_dispatch(int fd, int timeout);
\ No newline at end of file
+void epoller_dispatch(event_loop* loop, int timeout);
\ No newline at end of file
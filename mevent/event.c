@@ -6,9 +6,14 @@
 #include "servermanager.h"
 #include "event_loop.h"
 #include "epoll.h"
+#include "uring.h"
+#include "config.h"
 
 #include "misc/logger.h"
 
+
+static int edge_triggered = 0;     //连接使用EPOLLET，在所有loop创建连接之前设置
+
 static void event_error_handler(event* ev)
 {
     event_free(ev);
@@ -18,31 +23,46 @@ static void event_error_handler(event* ev)
 void event_handler(event* ev)
 {
     if (ev->active_event & (EPOLLHUP | EPOLLERR))  {
-        event_error_handler(ev);
-        return;
+        if (ev->event_read_handler == NULL)  {
+            event_error_handler(ev);
+            return;
+        }
+        ev->active_event |= EPOLLIN;     //交给读回调，读到0或出错时由上层关闭连接，event随连接一起释放
     }
 
+    ev->refs++;               //读回调中连接可能已经关闭，event_free只做标记，回调都返回后再释放
     if (ev->active_event & (EPOLLIN | EPOLLPRI))  {
         if (ev->event_read_handler)  {
             ev->event_read_handler(ev->fd, ev, ev->r_arg);
         }
     }
-    if (ev->active_event & EPOLLOUT)  {
+    if ((ev->active_event & EPOLLOUT) && !ev->freed)  {
         if (ev->event_write_handler)  {
             ev->event_write_handler(ev->fd, ev, ev->w_arg);
         }
     }
+    ev->refs--;
+    if (ev->freed && ev->refs == 0)  {
+        event_release(ev);
+    }
 }
 
-event* event_create(int fd, short event_flag, event_callback_pt read_cb,
+event* event_create(int fd, int event_flag, event_callback_pt read_cb,
                     void* r_arg, event_callback_pt write_cb, void* w_arg)
 {
-    event* ev = (event*)malloc(sizeof(event));
+    event* ev = (event*)mu_malloc(MEM_TAG_EVENT, sizeof(event));
     if (ev == NULL)  {
         debug_ret("file: %s, line: %d", __FILE__, __LINE__);
         return NULL;
     }
+    event_init(ev, fd, event_flag, read_cb, r_arg, write_cb, w_arg);
+    return ev;
+}
 
+/* 初始化嵌在其他对象里的event，内存由ev->release回收 */
+void event_init(event* ev, int fd, int event_flag, event_callback_pt read_cb,
+                void* r_arg, event_callback_pt write_cb, void* w_arg)
+{
     ev->fd = fd;
     ev->event_flag = event_flag;
     ev->active_event = 0;
@@ -52,20 +72,48 @@ event* event_create(int fd, short event_flag, event_callback_pt read_cb,
     ev->event_write_handler = write_cb;
     ev->w_arg = w_arg;
 
-    return ev;
+    ev->is_working = 0;
+    ev->epoll_fd = -1;
+    ev->loop = NULL;
+    ev->deferred_event = 0;
+    ev->ready_prev = NULL;
+    ev->ready_next = NULL;
+    ev->refs = 0;
+    ev->freed = 0;
+    ev->release = NULL;
+
+    ev->io_type = EVENT_IO_POLL;
+    ev->io_result = 0;
+    ev->io_buf = NULL;
+}
+
+/* refs为0之后真正回收内存 */
+void event_release(event* ev)
+{
+    if (ev->release)  {
+        ev->release(ev);
+    }
+    else  {
+        mu_free(ev);
+    }
 }
 
 void event_free(event* ev)
 {
     event_stop(ev);
     close(ev->fd);
-	free(ev);
+    if (ev->refs > 0)  {        //回调还没返回，或者io_uring还有操作引用着它
+        ev->freed = 1;
+        return;
+    }
+    event_release(ev);
 }
 
-void event_add_io(int epoll_fd, event* ev)
+void event_add_io(event_loop* loop, event* ev)
 {
-    epoller_add(epoll_fd, ev);
-    ev->epoll_fd = epoll_fd;
+    epoller_add(loop->epoll_fd, ev);
+    ev->epoll_fd = loop->epoll_fd;
+    ev->loop = loop;
     ev->is_working = 1;
 }
 
@@ -90,17 +138,106 @@ void event_add_flag(event* ev, int add_flag, int plus)
 
 void event_enable_writing(event* ev)
 {
+    if (ev->event_flag & EPOLLET)  {      //边沿触发时EPOLLOUT一直在监听，不用每次epoll_ctl
+        return;
+    }
     event_add_flag(ev, EPOLLOUT, 1);
 }
 
 void event_disable_writing(event* ev)
 {
+    if (ev->event_flag & EPOLLET)  {
+        return;
+    }
     event_add_flag(ev, EPOLLOUT, 0);
 }
 
 
+static void event_undefer(event* ev)
+{
+    if (ev->deferred_event == 0)  {
+        return;
+    }
+    event_loop* loop = ev->loop;
+    if (ev->ready_prev)  {
+        ev->ready_prev->ready_next = ev->ready_next;
+    }
+    else  {
+        loop->ready_head = ev->ready_next;
+    }
+    if (ev->ready_next)  {
+        ev->ready_next->ready_prev = ev->ready_prev;
+    }
+    else  {
+        loop->ready_tail = ev->ready_prev;
+    }
+    ev->ready_prev = ev->ready_next = NULL;
+    ev->deferred_event = 0;
+}
+
+/* 边沿触发下一次没有处理完(超过了预算)的事件不会再通知，放到loop的ready链表里，下一轮epoll_wait之后再处理 */
+void event_defer(event* ev, int active_event)
+{
+    if (ev->deferred_event)  {
+        ev->deferred_event |= active_event;
+        return;
+    }
+    event_loop* loop = ev->loop;
+    ev->deferred_event = active_event;
+    ev->ready_next = NULL;
+    ev->ready_prev = loop->ready_tail;
+    if (loop->ready_tail)  {
+        loop->ready_tail->ready_next = ev;
+    }
+    else  {
+        loop->ready_head = ev;
+    }
+    loop->ready_tail = ev;
+}
+
+void event_process_deferred(event_loop* loop)
+{
+    int n = 0;
+    event* ev;
+    for (ev = loop->ready_head; ev; ev = ev->ready_next)  {    //只处理本轮之前留下的，处理中再次推迟的留到下一轮
+        n++;
+    }
+    while (n-- > 0 && (ev = loop->ready_head) != NULL)  {
+        int active = ev->deferred_event;
+        event_undefer(ev);
+        ev->active_event = active;
+        event_handler(ev);
+    }
+}
+
+/* io_uring后端下让内核直接完成accept或recv，epoll后端下不起作用 */
+void event_set_io(event* ev, int io_type)
+{
+    if (epoller_backend() == IO_BACKEND_URING)  {
+        ev->io_type = io_type;
+    }
+}
+
+/* 只在io_uring后端使用，buf在写回调(发送完成)之前不能改动 */
+void event_submit_sendmsg(event* ev, struct msghdr* msg)
+{
+    uring_sendmsg(ev->epoll_fd, ev, msg);
+}
+
+void event_set_edge_triggered(int on)
+{
+    edge_triggered = on;
+}
+
+int event_edge_triggered()
+{
+    return edge_triggered;
+}
+
 void event_stop(event *ev)
 {
+    event_undefer(ev);
+
 	if (ev->is_working == 0)                   //判断事件ev是否在epoll中,防止重复删除同一事件
 		return;
 
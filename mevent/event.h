@@ -4,14 +4,29 @@
 
 typedef struct event_t event;
 typedef struct server_manager_t server_manager;
+typedef struct event_loop_t event_loop;
 
 typedef void (*event_callback_pt)(int fd, event* ev, void* arg);
+typedef void (*event_release_pt)(event* ev);
 
+/* io_uring后端下由内核直接完成的操作，结果放在io_result、io_buf里再调用读写回调 */
+enum EventIoType  {
+    EVENT_IO_POLL,        //只等待就绪，和epoll一样
+    EVENT_IO_ACCEPT,      //multishot accept，io_result是新连接的fd
+    EVENT_IO_RECV,        //multishot recv，数据在io_buf里，io_result是长度；写回调是一次send完成，io_result是发出的字节数
+};
+
+/* 前64字节是每次就绪都要用的：dispatch写active_event，event_handler读标志和回调；
+   其余的只在注册、推迟、释放时用到，放在后面 */
 struct event_t {
     int fd;
-    int event_flag;
     int active_event;
-    struct timeval time;
+    int event_flag;
+    int refs;             //正在使用它的回调数和io_uring中还没有最后完成的操作数，为0时才能真的释放
+    int freed;            //已经event_free，等refs为0再释放内存
+    int io_type;          //enum EventIoType，epoll后端下总是EVENT_IO_POLL
+    int io_result;
+    int deferred_event;   //还没处理完、留到下一轮的事件，非0时在loop的ready链表中
 
     event_callback_pt event_read_handler;
     void* r_arg;
@@ -19,20 +34,40 @@ struct event_t {
     event_callback_pt event_write_handler;
     void* w_arg;
 
+    char* io_buf;
+    event_loop* loop;
     int is_working;
     int epoll_fd;
+    event* ready_prev;
+    event* ready_next;
+    event_release_pt release;    //不为NULL时由它回收内存，event嵌在其他对象里时使用
 };
 
 
-event* event_create(int fd, short event_flag, event_callback_pt read_cb,
+event* event_create(int fd, int event_flag, event_callback_pt read_cb,
                     void* r_arg, event_callback_pt write_cb, void* w_arg);
+void event_init(event* ev, int fd, int event_flag, event_callback_pt read_cb,
+                void* r_arg, event_callback_pt write_cb, void* w_arg);
+void event_release(event* ev);
 
 int event_start(event* ev);
 void event_stop(event* ev);
 void event_free(event* ev);
 
-void event_add_io(int epoll_fd, event* ev);
+void event_add_io(event_loop* loop, event* ev);
+void event_modify_flag(event* ev, int new_flag);
+void event_add_flag(event* ev, int add_flag, int plus);
 void event_enable_writing(event* ev);
 void event_disable_writing(event* ev);
 
-void event_handler(event* ev);
\ No newline at end of file
+void event_handler(event* ev);
+
+void event_set_io(event* ev, int io_type);
+struct msghdr;
+void event_submit_sendmsg(event* ev, struct msghdr* msg);
+
+void event_set_edge_triggered(int on);
+int event_edge_triggered();
+
+void event_defer(event* ev, int active_event);
+void event_process_deferred(event_loop* loop);
\ No newline at end of file
@@ -1,14 +1,96 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include "event_loop.h"
+#include "event.h"
 #include "config.h"
 #include "epoll.h"
+#include "buffer_chain.h"
+#include "ring_buffer.h"
+#include "slab.h"
+#include "connection.h"
 
 #include "misc/logger.h"
 
+static int default_busy_poll_us = 0;       //新建的loop使用的轮询时间
+
+static void task_queue_push(event_loop* loop, loop_task* task)
+{
+    __atomic_store_n(&task->next, NULL, __ATOMIC_RELAXED);
+    loop_task* prev = __atomic_exchange_n(&loop->task_in, task, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, task, __ATOMIC_RELEASE);
+}
+
+/* 只在loop线程调用，队列为空时返回NULL */
+static loop_task* task_queue_pop(event_loop* loop)
+{
+    loop_task* out = loop->task_out;
+    loop_task* next = __atomic_load_n(&out->next, __ATOMIC_ACQUIRE);
+
+    if (out == &loop->task_stub)  {
+        if (next == NULL)  {
+            if (__atomic_load_n(&loop->task_in, __ATOMIC_ACQUIRE) == out)  {
+                return NULL;
+            }
+            while ((next = __atomic_load_n(&out->next, __ATOMIC_ACQUIRE)) == NULL)  {    //生产者已交换task_in但还没链接上
+                sched_yield();
+            }
+        }
+        loop->task_out = next;
+        out = next;
+        next = __atomic_load_n(&out->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next == NULL)  {
+        if (__atomic_load_n(&loop->task_in, __ATOMIC_ACQUIRE) == out)  {    //out是最后一个，放回stub才能把它取出来
+            task_queue_push(loop, &loop->task_stub);
+        }
+        while ((next = __atomic_load_n(&out->next, __ATOMIC_ACQUIRE)) == NULL)  {
+            sched_yield();
+        }
+    }
+    loop->task_out = next;
+    return out;
+}
+
+static void event_loop_do_tasks(event_loop* loop)
+{
+    loop_task* task;
+    while ((task = task_queue_pop(loop)) != NULL)  {
+        task->callback(loop, task->arg);       //回调后task可能已被释放
+    }
+}
+
+static void event_wakeup_callback(int fd, event* ev, void* arg)
+{
+    event_loop* loop = (event_loop*)arg;
+    uint64_t n;
+    if (read(fd, &n, sizeof(n)) < 0)  {
+        debug_msg("read eventfd failed, file : %s, line : %d", __FILE__, __LINE__);
+    }
+    __atomic_store_n(&loop->wakeup_pending, 0, __ATOMIC_SEQ_CST);    //先清标志再取任务，之后的投递会重新唤醒
+    event_loop_do_tasks(loop);
+}
+
+/* 连接的缓冲区数据发完读完就还给pool，一个周期里一直没有借出去的再还给系统，空闲时内存降下来 */
+static void event_loop_shrink_pools(void* arg)
+{
+    event_loop* loop = (event_loop*)arg;
+    ring_pool_shrink(loop->read_pool);
+    buffer_pool_shrink(loop->chunk_pool);
+    if (loop->conn_slab)  {
+        slab_shrink(loop->conn_slab);
+    }
+}
+
 event_loop* event_loop_create()
 {
-    event_loop* loop = (event_loop*)mu_malloc(sizeof(event_loop));
+    event_loop* loop = (event_loop*)mu_malloc(MEM_TAG_LOOP, sizeof(event_loop));
     if (loop == NULL)  {
         debug_ret("create event loop failed, file : %s, line : %d", __FILE__, __LINE__);
         return NULL;
@@ -21,13 +103,249 @@ event_loop* event_loop_create()
         return NULL;
     }
 
+    loop->index = -1;
+    loop->cpu = -1;
+    loop->numa_node = -1;
+    loop->tid = pthread_self();
+    loop->task_stub.callback = NULL;
+    loop->task_stub.arg = NULL;
+    loop->task_stub.next = NULL;
+    loop->task_in = &loop->task_stub;
+    loop->task_out = &loop->task_stub;
+    loop->wakeup_pending = 0;
+    loop->conn_num = 0;
+    loop->pending_conns = 0;
+    loop->pending_bytes = 0;
+    loop->read_count = 0;
+    loop->conn_list = NULL;
+    loop->read_waiters = NULL;
+    loop->conn_slab = NULL;
+    loop->ready_head = NULL;
+    loop->ready_tail = NULL;
+    loop->events = NULL;
+    loop->events_cap = 0;
+    loop->events_low_rounds = 0;
+    loop->events_full = 0;
+    loop->active_num = 0;
+    loop->busy_poll_us = default_busy_poll_us;
+    loop->spin_us = 0;
+    loop->spin_hits = 0;
+    loop->block_us = 0;
+    loop->block_wakeups = 0;
+    loop->date_sec = 0;
+    loop->date[0] = '\0';
+
+    loop->timers = timer_manager_create(TIMER_SLACK);
+    if (loop->timers == NULL)  {
+        debug_ret("create timer manager failed, file : %s, line : %d", __FILE__, __LINE__);
+        epoller_free(loop->epoll_fd);
+        mu_free(loop);
+        return NULL;
+    }
+    event_loop_update_time(loop);
+
+    loop->chunk_pool = buffer_pool_create();
+    if (loop->chunk_pool == NULL)  {
+        debug_ret("create buffer pool failed, file : %s, line : %d", __FILE__, __LINE__);
+        timer_manager_free(loop->timers);
+        epoller_free(loop->epoll_fd);
+        mu_free(loop);
+        return NULL;
+    }
+
+    loop->read_pool = ring_pool_create(RING_POOL_LIMIT);
+    if (loop->read_pool == NULL)  {
+        debug_ret("create ring pool failed, file : %s, line : %d", __FILE__, __LINE__);
+        buffer_pool_free(loop->chunk_pool);
+        timer_manager_free(loop->timers);
+        epoller_free(loop->epoll_fd);
+        mu_free(loop);
+        return NULL;
+    }
+    event_loop_add_timer(loop, POOL_SHRINK_INTERVAL, TIMER_OPT_REPEAT, event_loop_shrink_pools, loop);
+
+    loop->recv_buf = (char*)mu_malloc(MEM_TAG_LOOP, RECV_BUF_SIZE);
+    if (loop->recv_buf == NULL)  {
+        debug_ret("create recv buffer failed, file : %s, line : %d", __FILE__, __LINE__);
+        ring_pool_free(loop->read_pool);
+        buffer_pool_free(loop->chunk_pool);
+        timer_manager_free(loop->timers);
+        epoller_free(loop->epoll_fd);
+        mu_free(loop);
+        return NULL;
+    }
+
+    if (epoller_backend() == IO_BACKEND_EPOLL)  {        //工作线程的loop在自己的线程里创建，数组在本NUMA节点
+        loop->events = (struct epoll_event*)mu_malloc(MEM_TAG_LOOP, sizeof(struct epoll_event) * MAX_EVENTS);
+        if (loop->events == NULL)  {
+            debug_ret("create epoll event array failed, file : %s, line : %d", __FILE__, __LINE__);
+            mu_free(loop->recv_buf);
+            ring_pool_free(loop->read_pool);
+            buffer_pool_free(loop->chunk_pool);
+            timer_manager_free(loop->timers);
+            epoller_free(loop->epoll_fd);
+            mu_free(loop);
+            return NULL;
+        }
+        loop->events_cap = MAX_EVENTS;
+    }
+
+    loop->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wakeup_fd == -1)  {
+        debug_ret("create eventfd failed, file : %s, line : %d", __FILE__, __LINE__);
+        mu_free(loop->events);
+        mu_free(loop->recv_buf);
+        ring_pool_free(loop->read_pool);
+        buffer_pool_free(loop->chunk_pool);
+        timer_manager_free(loop->timers);
+        epoller_free(loop->epoll_fd);
+        mu_free(loop);
+        return NULL;
+    }
+    loop->wakeup_event = event_create(loop->wakeup_fd, EPOLLIN, event_wakeup_callback, loop, NULL, NULL);
+    if (loop->wakeup_event == NULL)  {
+        close(loop->wakeup_fd);
+        mu_free(loop->events);
+        mu_free(loop->recv_buf);
+        ring_pool_free(loop->read_pool);
+        buffer_pool_free(loop->chunk_pool);
+        timer_manager_free(loop->timers);
+        epoller_free(loop->epoll_fd);
+        mu_free(loop);
+        return NULL;
+    }
+    event_add_io(loop, loop->wakeup_event);
+
     return loop;
 }
 
+/* 在创建loop之前调用 */
+void event_loop_set_busy_poll(int us)
+{
+    default_busy_poll_us = us > 0 ? us : 0;
+}
+
+/* 在dispatch等待返回后调用，这一轮的回调和定时器都用这个时间；墙上时间只要到秒，用COARSE就够了 */
+void event_loop_update_time(event_loop* loop)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    loop->now_ms = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    loop->wall_sec = ts.tv_sec;
+    loop->timers->now = loop->now_ms;         //回调里新加的定时器从这一刻开始计时
+}
+
+static const char* week_days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char* month_names[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+/* 例如 Sun, 06 Nov 1994 08:49:37 GMT，不经过locale，同一秒内的响应共用 */
+const char* event_loop_http_date(event_loop* loop)
+{
+    if (loop->date_sec != loop->wall_sec || loop->date[0] == '\0')  {
+        struct tm tm;
+        gmtime_r(&loop->wall_sec, &tm);
+        snprintf(loop->date, sizeof(loop->date), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                 week_days[tm.tm_wday], tm.tm_mday, month_names[tm.tm_mon], tm.tm_year + 1900,
+                 tm.tm_hour, tm.tm_min, tm.tm_sec);
+        loop->date_sec = loop->wall_sec;
+    }
+    return loop->date;
+}
+
+static long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* 统计只由本线程写，其他线程原子读取 */
+static void event_loop_account(long* counter, long n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
 void event_loop_run(event_loop* loop)
 {
-    int timeout = -1;
+    long start = 0;               //只有开了轮询才读时钟，否则每次唤醒都多一次clock_gettime
+    if (loop->busy_poll_us > 0)  {
+        start = now_us();
+    }
+    long last_active = start;
     while(1)  {
-        epoller_dispatch(loop->epoll_fd, timeout);
+        int spinning = loop->busy_poll_us > 0 && start - last_active < loop->busy_poll_us;   //刚有过事件，先不睡眠
+        int timeout = (loop->ready_head || spinning) ? 0 : timer_manager_timeout(loop->timers, loop->now_ms);   //有推迟的事件也不阻塞
+        epoller_dispatch(loop, timeout);          //等待返回后更新了loop的时间
+        event_process_deferred(loop);
+        timer_manager_expire(loop->timers, loop->now_ms);      //先处理完这一批I/O再处理到期的定时器
+        if (loop->read_waiters && loop->read_pool->released)  {
+            connection_wake_readers(loop);
+        }
+
+        if (loop->busy_poll_us == 0)  {
+            continue;
+        }
+        long end = now_us();
+        if (loop->active_num > 0)  {
+            last_active = end;
+        }
+        if (timeout != 0)  {
+            event_loop_account(&loop->block_us, end - start);
+            event_loop_account(&loop->block_wakeups, 1);
+        }
+        else if (spinning && loop->active_num == 0)  {
+            event_loop_account(&loop->spin_us, end - start);
+        }
+        else if (spinning)  {
+            event_loop_account(&loop->spin_hits, 1);
+        }
+        start = end;              //下一轮从这里开始，不用再读一次
     }
-}
\ No newline at end of file
+}
+
+/* 定时器回调在loop线程中执行，这几个函数也只能在loop线程中调用 */
+timer* event_loop_add_timer(event_loop* loop, int time_out, enum TimerOptions type, timeout_callback_pt callback, void* arg)
+{
+    return timer_manager_add(loop->timers, time_out, type, callback, arg);
+}
+
+void event_loop_cancel_timer(event_loop* loop, timer* t)
+{
+    if (t)  {
+        timer_manager_cancel(loop->timers, t);
+    }
+}
+
+void event_loop_reset_timer(event_loop* loop, timer* t, int time_out)
+{
+    timer_manager_reset(loop->timers, t, time_out);
+}
+
+int event_loop_in_loop_thread(event_loop* loop)
+{
+    return pthread_equal(loop->tid, pthread_self());
+}
+
+/* 可在任意线程调用，task在loop线程中执行 */
+void event_loop_post(event_loop* loop, loop_task* task)
+{
+    task_queue_push(loop, task);
+    if (__atomic_exchange_n(&loop->wakeup_pending, 1, __ATOMIC_SEQ_CST) == 0)  {
+        uint64_t one = 1;
+        if (write(loop->wakeup_fd, &one, sizeof(one)) < 0)  {
+            debug_msg("write eventfd failed, file : %s, line : %d", __FILE__, __LINE__);
+        }
+    }
+}
+
+void event_loop_run_in_loop(event_loop* loop, loop_task* task)
+{
+    if (event_loop_in_loop_thread(loop))  {
+        task->callback(loop, task->arg);
+    }
+    else  {
+        event_loop_post(loop, task);
+    }
+}
@@ -1,10 +1,90 @@
 #pragma once
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include "timer.h"
+
+typedef struct event_t event;
+struct epoll_event;
+typedef struct connection_t connection;
+typedef struct event_loop_t event_loop;
+typedef struct loop_task_t loop_task;
+typedef struct buffer_pool_t buffer_pool;
+typedef struct ring_pool_t ring_pool;
+typedef struct slab_cache_t slab_cache;
+
+typedef void (*loop_task_pt)(event_loop* loop, void* arg);
+
+/* 投递到其他loop执行的任务，内存由投递方管理，回调里可以释放 */
+struct loop_task_t  {
+    loop_task_pt callback;
+    void* arg;
+    loop_task* next;
+};
 
 struct event_loop_t  {
     int epoll_fd;
-};
+    int index;                 //在g_loops中的下标，主线程的loop为-1
+    int cpu;                   //绑定的cpu，没有绑核为-1
+    int numa_node;             //所在的NUMA节点，未知为-1
+    pthread_t tid;             //loop所在线程
 
-typedef struct event_loop_t event_loop;
+    int wakeup_fd;             //eventfd，其他线程投递任务后唤醒epoll_wait
+    event* wakeup_event;
+    int wakeup_pending;        //已经写过eventfd还没被处理，合并多次唤醒
+
+    loop_task* task_in;        //无锁MPSC队列，生产者在这里入队
+    loop_task* task_out;       //只有loop线程出队
+    loop_task task_stub;
+
+    /* 负载计数，由loop线程维护，分派连接时其他线程原子读取 */
+    int conn_num;              //本loop上的连接数
+    int pending_conns;         //已分派给本loop但还未接管的连接数
+    long pending_bytes;        //连接写缓冲区中尚未发出的字节数
+    long read_count;           //处理过的连接可读事件数，用来判断各loop的繁忙程度
+
+    connection* conn_list;     //本loop上的所有连接
+    connection* read_waiters;  //读缓冲区到了上限、暂停读取的连接，read_pool有内存还回来后重新开始读
+
+    timer_manager* timers;     //只在loop线程中使用，不需要加锁
+    buffer_pool* chunk_pool;   //本loop上连接的写缓冲区块
+    ring_pool* read_pool;      //本loop上连接的读缓冲区，有数据时才借用
+    char* recv_buf;            //连接没有积压的数据时直接读到这里，在原地解析，RECV_BUF_SIZE大小
+    slab_cache* conn_slab;     //连接块的缓存，第一个连接建立时创建
+
+    int64_t now_ms;            //CLOCK_MONOTONIC的毫秒，每次dispatch等待返回时更新一次
+    time_t  wall_sec;          //同时更新的墙上时间，秒
+    time_t  date_sec;          //date是哪一秒格式化的
+    char    date[32];          //RFC 7231格式的GMT时间，每秒最多格式化一次
+
+    event* ready_head;         //推迟到下一轮处理的事件
+    event* ready_tail;
+
+    struct epoll_event* events;    //epoll_wait用的数组，随每次的就绪数伸缩
+    int events_cap;
+    int events_low_rounds;     //连续多少次就绪数不到数组的1/4
+    long events_full;          //数组被填满的次数，经常满说明最大值太小
+    int active_num;            //上一次dispatch处理的事件数
+
+    int busy_poll_us;          //有事件后这么多微秒内不阻塞，用timeout 0轮询，0表示一直阻塞
+    long spin_us;              //轮询了但没有事件的时间，是忙等多花的cpu
+    long spin_hits;            //轮询到事件的次数，这些请求省掉了一次线程唤醒
+    long block_us;             //阻塞等待那几轮的时间
+    long block_wakeups;
+};
 
 event_loop* event_loop_create();
-void event_loop_run(event_loop* el);
\ No newline at end of file
+void event_loop_run(event_loop* el);
+
+void event_loop_set_busy_poll(int us);
+
+void event_loop_update_time(event_loop* loop);
+const char* event_loop_http_date(event_loop* loop);
+
+timer* event_loop_add_timer(event_loop* loop, int time_out, enum TimerOptions type, timeout_callback_pt callback, void* arg);
+void event_loop_cancel_timer(event_loop* loop, timer* t);
+void event_loop_reset_timer(event_loop* loop, timer* t, int time_out);
+
+int event_loop_in_loop_thread(event_loop* loop);
+void event_loop_post(event_loop* loop, loop_task* task);
+void event_loop_run_in_loop(event_loop* loop, loop_task* task);
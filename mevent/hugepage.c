@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "hugepage.h"
+#include "config.h"
+
+#include "misc/logger.h"
+
+#ifndef MAP_HUGETLB
+    #define MAP_HUGETLB 0x40000
+#endif
+
+static long hugetlb_pages = 0;
+static long thp_pages = 0;
+static int hugetlb_unavailable = 0;       //失败过一次就不再尝试，系统没有预留大页时每次都会失败
+
+static size_t hugepage_round(size_t size)
+{
+    return (size + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+}
+
+/* 返回按HUGEPAGE_SIZE对齐的内存，size向上取整到HUGEPAGE_SIZE；huge返回是否是MAP_HUGETLB，释放时传回；
+   不经过mu_malloc，由调用者用mem_account记账 */
+void* hugepage_map(size_t size, int* huge)
+{
+    size = hugepage_round(size);
+    if (!__atomic_load_n(&hugetlb_unavailable, __ATOMIC_RELAXED))  {
+        void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED)  {
+            *huge = 1;
+            __atomic_add_fetch(&hugetlb_pages, size / HUGEPAGE_SIZE, __ATOMIC_RELAXED);
+            return ptr;
+        }
+        __atomic_store_n(&hugetlb_unavailable, 1, __ATOMIC_RELAXED);
+        debug_msg("MAP_HUGETLB failed, falls back to transparent hugepages");
+    }
+
+    char* raw = (char*)mmap(NULL, size + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)  {
+        return NULL;
+    }
+    char* ptr = (char*)(((uintptr_t)raw + HUGEPAGE_SIZE - 1) & ~(uintptr_t)(HUGEPAGE_SIZE - 1));
+    if (ptr > raw)  {
+        munmap(raw, ptr - raw);      //多映射的头尾去掉，留下对齐的部分
+    }
+    if (raw + HUGEPAGE_SIZE > ptr)  {
+        munmap(ptr + size, raw + HUGEPAGE_SIZE - ptr);
+    }
+    madvise(ptr, size, MADV_HUGEPAGE);
+    *huge = 0;
+    __atomic_add_fetch(&thp_pages, size / HUGEPAGE_SIZE, __ATOMIC_RELAXED);
+    return ptr;
+}
+
+void hugepage_unmap(void* ptr, size_t size, int huge)
+{
+    size = hugepage_round(size);
+    munmap(ptr, size);
+    __atomic_sub_fetch(huge ? &hugetlb_pages : &thp_pages, size / HUGEPAGE_SIZE, __ATOMIC_RELAXED);
+}
+
+/* 读smaps_rollup要遍历所有映射，只在打印统计时调用 */
+void hugepage_get_stat(hugepage_stat* st)
+{
+    st->hugetlb_pages = __atomic_load_n(&hugetlb_pages, __ATOMIC_RELAXED);
+    st->thp_pages = __atomic_load_n(&thp_pages, __ATOMIC_RELAXED);
+    st->anon_huge_kb = -1;
+
+    FILE* fp = fopen("/proc/self/smaps_rollup", "r");
+    if (fp == NULL)  {
+        return;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), fp))  {
+        if (sscanf(line, "AnonHugePages: %ld kB", &st->anon_huge_kb) == 1)  {
+            break;
+        }
+    }
+    fclose(fp);
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include <stddef.h>
+
+/* 按2MB大页映射内存：先用MAP_HUGETLB(需要系统预留大页)，失败时映射普通内存并对齐到2MB，用madvise请求透明大页 */
+
+#define HUGEPAGE_SIZE ((size_t)2 << 20)
+
+typedef struct hugepage_stat_t  {
+    long hugetlb_pages;       //MAP_HUGETLB映射的大页数，这些一定是大页
+    long thp_pages;           //请求了透明大页的2MB区域数
+    long anon_huge_kb;        //内核实际用透明大页支撑的内存，来自/proc/self/smaps_rollup
+} hugepage_stat;
+
+
+void* hugepage_map(size_t size, int* huge);
+void hugepage_unmap(void* ptr, size_t size, int huge);
+
+void hugepage_get_stat(hugepage_stat* st);
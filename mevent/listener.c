@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
@@ -13,11 +14,12 @@
 #include "event.h"
 #include "connection.h"
 #include "event_loop.h"
+#include "config.h"
 
 #include "misc/logger.h"
 
 
-extern event_loop *g_loops[];
+extern event_loop **g_loops;
 
 
 inet_address addr_create(const char *ip, int port)
@@ -44,55 +46,33 @@ static void default_disconnected_callback(connection* conn)
 
 }
 
-static void event_accept_callback(int listenfd, event* ev, void* arg)
-{
-    server_manager *manager = (server_manager *)arg;
-	inet_address client_addr;
-	socklen_t clilen = sizeof(client_addr.addr);
-	
-	int connfd = accept(listenfd, (struct sockaddr *)&client_addr.addr,	&clilen);
-	if (connfd < 0)  {
-		int save = errno;
-		if (save == EAGAIN || save == ECONNABORTED || save == EINTR
-			|| save == EPROTO || save == EPERM || save == EMFILE)
-		{
-			return;
-		}
-		else  {
-			debug_sys("accept failed, file: %s, line: %d", __FILE__, __LINE__);
-		}
-	}
-
-	
-	//char buff[50];
-	//printf("connection from %s, port %d\n",
-	//		inet_ntop(AF_INET, &client_addr.addr.sin_addr, buff, sizeof(buff)),
-	//		ntohs(client_addr.addr.sin_port));
-
-	fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
-
-    static int i = 0;
-	if (i >= manager->loop_num)
-		i = 0;
+typedef struct accepted_conn_t  {
+    int connfd;
+    int port;
+} accepted_conn;
 
-    event_loop* loop = NULL;
-    if (manager->loop_num == 0)  {     //如果没有开启线程则用主线程的
-        loop = manager->loop;
-    }
-    else  {
-        loop = g_loops[i++];
-    }
+/* 一次唤醒中accept得到的、属于同一个loop的fd，整批投递给它，由它在自己的线程里创建connection */
+typedef struct accept_batch_t  {
+    loop_task task;
+    server_manager* manager;
+    int num;
+    accepted_conn conns[];
+} accept_batch;
 
-    int tcp_nodelay = 1;
-    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY,(const void *) &tcp_nodelay, sizeof(int));                               
-	
-	connection *conn = connection_create(loop, connfd, manager->msg_callback);      //后面的参数是指有消息时的用户回调
+static void listener_adopt_connection(event_loop* loop, server_manager* manager, accepted_conn* ac)   //in the loop thread owning the connection
+{
+	connection *conn = connection_create(loop, ac->connfd, manager->msg_callback);      //后面的参数是指有消息时的用户回调
 	if (conn == NULL)  {
 		debug_quit("create connection failed, file: %s, line: %d", __FILE__, __LINE__);
 	}
-    conn->port = ntohs(client_addr.addr.sin_port);  //used for debug
-    conn->time_on_connect = time(NULL);
+    conn->port = ac->port;  //used for debug
+    conn->time_on_connect = loop->wall_sec;
     conn->disconnected_cb = default_disconnected_callback;
+
+    if (manager->busy_poll_socket && loop->busy_poll_us > 0)  {      //读这个socket时内核也先轮询网卡队列
+        int us = loop->busy_poll_us;
+        setsockopt(ac->connfd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));
+    }
 	
 	if (manager->new_connection_callback) {
         conn->connected_cb = manager->new_connection_callback;
@@ -102,25 +82,140 @@ static void event_accept_callback(int listenfd, event* ev, void* arg)
     connection_start(conn, loop);
 }
 
+static void listener_adopt_batch(event_loop* loop, void* arg)
+{
+    accept_batch* batch = (accept_batch*)arg;
+    int i;
+    for (i = 0; i < batch->num; i++)  {
+        listener_adopt_connection(loop, batch->manager, &batch->conns[i]);
+    }
+    __atomic_sub_fetch(&loop->pending_conns, batch->num, __ATOMIC_RELAXED);
+    mu_free(batch);
+}
+
+static void listener_dispatch(listener* ls, accepted_conn* conns, int num)
+{
+    server_manager *manager = ls->manager;
+    int n;
+
+    if (ls->loop || manager->loop_num == 0)  {     //reuse_port模式下loop自己accept；没有开启线程则用主线程的
+        event_loop* loop = ls->loop ? ls->loop : manager->loop;
+        for (n = 0; n < num; n++)  {
+            listener_adopt_connection(loop, manager, &conns[n]);
+        }
+        return;
+    }
+
+    accept_batch* batches[manager->loop_num];
+    memset(batches, 0, sizeof(batches));
+
+    for (n = 0; n < num; n++)  {
+        event_loop* loop = server_manager_pick_loop(manager);
+        int idx = loop->index;
+        if (batches[idx] == NULL)  {
+            batches[idx] = (accept_batch*)mu_malloc(MEM_TAG_CONN, sizeof(accept_batch) + sizeof(accepted_conn) * (num - n));
+            if (batches[idx] == NULL)  {
+                debug_ret("dispatch connection failed, file: %s, line: %d", __FILE__, __LINE__);
+                __atomic_sub_fetch(&loop->pending_conns, 1, __ATOMIC_RELAXED);
+                close(conns[n].connfd);
+                continue;
+            }
+            batches[idx]->manager = manager;
+            batches[idx]->num = 0;
+            batches[idx]->task.callback = listener_adopt_batch;
+            batches[idx]->task.arg = batches[idx];
+        }
+        batches[idx]->conns[batches[idx]->num++] = conns[n];
+    }
+
+    for (n = 0; n < manager->loop_num; n++)  {
+        if (batches[n])  {
+            event_loop_post(g_loops[n], &batches[n]->task);     //工作线程的epoll只由它自己操作
+        }
+    }
+}
+
+static void event_accept_callback(int listenfd, event* ev, void* arg)
+{
+    listener* ls = (listener*)arg;
+    server_manager *manager = ls->manager;
+    int tcp_nodelay = 1;
+
+    if (ev->io_type == EVENT_IO_ACCEPT)  {       //io_uring的multishot accept，每个完成事件带一个已经accept好的连接
+        accepted_conn ac;
+        ac.connfd = ev->io_result;
+        ac.port = 0;
+        setsockopt(ac.connfd, IPPROTO_TCP, TCP_NODELAY, (const void *) &tcp_nodelay, sizeof(int));
+        listener_dispatch(ls, &ac, 1);
+        return;
+    }
+
+    int budget = manager->accept_budget > 0 ? manager->accept_budget : 1;
+    accepted_conn conns[budget];
+    int num = 0;
+
+    while (num < budget)  {          //一次唤醒尽量取完backlog，但不超过budget，避免饿死其他事件
+        inet_address client_addr;
+        socklen_t clilen = sizeof(client_addr.addr);
+
+        int connfd = accept4(listenfd, (struct sockaddr *)&client_addr.addr, &clilen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0)  {
+            int save = errno;
+            if (save == ECONNABORTED || save == EINTR || save == EPROTO)  {
+                continue;
+            }
+            else if (save == EAGAIN || save == EWOULDBLOCK || save == EPERM || save == EMFILE
+                || save == ENFILE || save == ENOBUFS || save == ENOMEM)
+            {
+                break;
+            }
+            else  {
+                debug_sys("accept failed, file: %s, line: %d", __FILE__, __LINE__);
+            }
+        }
+
+        //char buff[50];
+        //printf("connection from %s, port %d\n",
+        //		inet_ntop(AF_INET, &client_addr.addr.sin_addr, buff, sizeof(buff)),
+        //		ntohs(client_addr.addr.sin_port));
+
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY,(const void *) &tcp_nodelay, sizeof(int));
+
+        conns[num].connfd = connfd;
+        conns[num].port = ntohs(client_addr.addr.sin_port);
+        num++;
+    }
+
+    if (num > 0)  {
+        listener_dispatch(ls, conns, num);
+    }
+}
+
+
+static void listener_start(event_loop* loop, void* arg)      //in the loop accepting on the listener
+{
+    listener* ls = (listener*)arg;
+    event_add_io(loop, ls->ls_event);
+}
+
 
 #define ERR_SOCKET 1
 #define ERR_BIND   2
 #define ERR_LISTEN 3
 #define ERR_EVENT  4
 
-listener* listener_create(server_manager* manager, inet_address ls_addr,
-                         message_callback_pt msg_cb, connection_callback_pt new_con_cb)
+static listener* listener_open(server_manager* manager, inet_address ls_addr, event_loop* loop, int reuse_port)
 {
-    listener* ls = (listener*)malloc(sizeof(listener));
+    listener* ls = (listener*)mu_malloc(MEM_TAG_CONN, sizeof(listener));
     if (ls == NULL)  {
         debug_ret("create listener failed, file: %s, line: %d", __FILE__, __LINE__);
         return NULL;
     }
 
     ls->listen_addr = ls_addr;
-
-    manager->msg_callback = msg_cb;
-    manager->new_connection_callback = new_con_cb;
+    ls->loop = loop;
+    ls->manager = manager;
+    ls->next = NULL;
 
     int bOk = -1;
     event* lev = NULL;
@@ -134,6 +229,9 @@ listener* listener_create(server_manager* manager, inet_address ls_addr,
 
         int opt = 1;
         setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (reuse_port)  {           //多个socket绑定同一地址，由内核在它们之间分发连接
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+        }
         int ret = bind(listen_fd, (struct sockaddr *)&ls_addr.addr, sizeof(ls_addr.addr));
         if (ret < 0)  {
             bOk = ERR_BIND;
@@ -147,11 +245,12 @@ listener* listener_create(server_manager* manager, inet_address ls_addr,
         }
 
         lev = event_create(listen_fd, EPOLLIN | EPOLLPRI,
-                                    event_accept_callback, manager, NULL, NULL);       //后面参数是读写回调及其参数
+                                    event_accept_callback, ls, NULL, NULL);       //后面参数是读写回调及其参数
         if (lev == NULL)  {
             bOk = ERR_EVENT;
             break;
         }
+        event_set_io(lev, EVENT_IO_ACCEPT);
 
         bOk = 0;
     } while(0);
@@ -161,13 +260,48 @@ listener* listener_create(server_manager* manager, inet_address ls_addr,
         if (listen_fd > 0)  {
             close(listen_fd);
         }
-        free(ls);
+        mu_free(ls);
         return NULL;
-    }  
-    else  {
-        event_add_io(manager->loop->epoll_fd, lev);
     }
-	
+
+    ls->listen_fd = listen_fd;
+    ls->ls_event = lev;
+    ls->start_task.callback = listener_start;
+    ls->start_task.arg = ls;
+    event_loop_run_in_loop(loop ? loop : manager->loop, &ls->start_task);     //io_uring的提交队列只能由loop自己的线程操作
     return ls;
 }
 
+listener* listener_create(server_manager* manager, inet_address ls_addr,
+                         message_callback_pt msg_cb, connection_callback_pt new_con_cb)
+{
+    manager->msg_callback = msg_cb;
+    manager->new_connection_callback = new_con_cb;
+
+    if (!manager->reuse_port || manager->loop_num == 0)  {     //主线程accept后分发给各个loop
+        return listener_open(manager, ls_addr, NULL, 0);
+    }
+
+    listener* head = NULL;
+    int i;
+    for (i = manager->loop_num - 1; i >= 0; i--)  {            //每个工作线程一个SO_REUSEPORT监听socket
+        listener* ls = listener_open(manager, ls_addr, g_loops[i], 1);
+        if (ls == NULL)  {
+            listener_free(head);
+            return NULL;
+        }
+        ls->next = head;
+        head = ls;
+    }
+    return head;
+}
+
+void listener_free(listener* ls)
+{
+    while (ls)  {
+        listener* next = ls->next;
+        event_free(ls->ls_event);       //移出epoll并关闭listen_fd
+        mu_free(ls);
+        ls = next;
+    }
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include "event_loop.h"
 
 
 
@@ -18,14 +19,20 @@ typedef void (*message_callback_pt)(connection *conn);
 
 
 typedef struct listener_t listener;
+typedef struct event_loop_t event_loop;
+typedef struct event_t event;
+typedef struct server_manager_t server_manager;
 
 struct listener_t  {
     inet_address listen_addr;
-    //event* ls_event;
+    int listen_fd;
+    event_loop* loop;             //loop accepting on listen_fd, NULL means dispatch to g_loops
+    server_manager* manager;
+    listener* next;               //per worker listeners when manager->reuse_port is on
+    event* ls_event;
+    loop_task start_task;         //listen_fd由accept它的loop自己加入事件循环
 };
 
-typedef struct server_manager_t server_manager;
-
 listener* listener_create(server_manager* manager, inet_address ls_addr,
                          message_callback_pt msg_cb, connection_callback_pt new_con_cb);
 
@@ -1,20 +1,282 @@
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "ring_buffer.h"
 #include "config.h"
 
-ring_buffer* ring_buffer_new()
+#include "misc/logger.h"
+
+ring_pool* ring_pool_create(long limit_bytes)
 {
-    ring_buffer* rb = (ring_buffer*)mu_malloc(sizeof(ring_buffer));
-    memset(rb, 0, sizeof(ring_buffer));
+    ring_pool* pool = (ring_pool*)mu_malloc(MEM_TAG_BUFFER, sizeof(ring_pool));
+    if (pool)  {
+        memset(pool, 0, sizeof(ring_pool));
+        pool->limit_bytes = limit_bytes;
+    }
+    return pool;
+}
+
+
+ring_buffer* ring_buffer_new(ring_pool* pool)
+{
+    ring_buffer* rb = (ring_buffer*)mu_malloc(MEM_TAG_BUFFER, sizeof(ring_buffer));
+    if (rb)  {
+        ring_buffer_init(rb, pool);
+    }
     return rb;
 }
 
+/* 初始化嵌在其他对象里的ring_buffer，用完后ring_buffer_clear */
+void ring_buffer_init(ring_buffer* rb, ring_pool* pool)
+{
+    memset(rb, 0, sizeof(ring_buffer));
+    rb->pool = pool;
+}
 
-void ring_buffer_free(ring_buffer* rb)
+
+/* 第一次分配的大小，是页大小的倍数，以后每次翻倍 */
+static int ring_buffer_base_cap()
 {
-    if (rb->msg)  {
+    static int base = 0;
+    if (base == 0)  {
+        int page = sysconf(_SC_PAGESIZE);
+        base = (RING_BUFFER_SIZE + page - 1) / page * page;
+    }
+    return base;
+}
+
+static int ring_pool_class(int cap)
+{
+    int c;
+    for (c = 0; c < RING_POOL_CLASSES; c++)  {
+        if (ring_buffer_base_cap() << c == cap)  {
+            return c;
+        }
+    }
+    return -1;
+}
+
+/* 同一个memfd映射到相邻的两段地址，cap必须是页大小的倍数 */
+static char* ring_buffer_map(int cap)
+{
+    int fd = memfd_create("ring_buffer", MFD_CLOEXEC);
+    if (fd < 0)  {
+        return NULL;
+    }
+    char* base = NULL;
+    if (ftruncate(fd, cap) == 0)  {
+        base = (char*)mmap(NULL, (size_t)cap * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);     //先占住两倍的地址
+        if (base == MAP_FAILED)  {
+            base = NULL;
+        }
+        else if (mmap(base, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+                 || mmap(base + cap, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)  {
+            munmap(base, (size_t)cap * 2);
+            base = NULL;
+        }
+    }
+    close(fd);
+    if (base)  {
+        mem_account(MEM_TAG_BUFFER, cap);      //不经过mu_malloc，单独记账
+    }
+    return base;
+}
+
+static void ring_buffer_unmap(char* msg, int cap)
+{
+    munmap(msg, (size_t)cap * 2);
+    mem_account(MEM_TAG_BUFFER, -cap);
+}
+
+void ring_pool_free(ring_pool* pool)
+{
+    if (pool == NULL)  {
+        return;
+    }
+    int c;
+    for (c = 0; c < RING_POOL_CLASSES; c++)  {
+        while (pool->free_num[c] > 0)  {
+            ring_buffer_unmap(pool->free[c][--pool->free_num[c]], ring_buffer_base_cap() << c);
+        }
+    }
+    mu_free(pool);
+}
+
+/* 定时调用，上个周期里一直空闲的映射还给系统 */
+void ring_pool_shrink(ring_pool* pool)
+{
+    int c;
+    for (c = 0; c < RING_POOL_CLASSES; c++)  {
+        int cap = ring_buffer_base_cap() << c;
+        int n = pool->low[c];
+        while (n-- > 0 && pool->free_num[c] > 0)  {
+            ring_buffer_unmap(pool->free[c][--pool->free_num[c]], cap);
+            pool->mapped_bytes -= cap;
+            pool->released = 1;
+        }
+        pool->low[c] = pool->free_num[c];
+    }
+}
+
+/* 没有这个大小的空闲映射，再映射一块就超过上限了 */
+static int ring_pool_full(ring_pool* pool, int cap)
+{
+    int c = ring_pool_class(cap);
+    if (c >= 0 && pool->free_num[c] > 0)  {
+        return 0;
+    }
+    return pool->limit_bytes > 0 && pool->mapped_bytes + cap > pool->limit_bytes;
+}
+
+/* 从pool中借一块映射好的内存，没有空闲的就映射一块新的 */
+static char* ring_pool_get(ring_pool* pool, int cap)
+{
+    int c = ring_pool_class(cap);
+    if (c >= 0 && pool->free_num[c] > 0)  {
+        char* msg = pool->free[c][--pool->free_num[c]];
+        if (pool->free_num[c] < pool->low[c])  {
+            pool->low[c] = pool->free_num[c];
+        }
+        return msg;
+    }
+    char* msg = ring_buffer_map(cap);
+    if (msg)  {
+        pool->mapped_bytes += cap;
+    }
+    return msg;
+}
+
+static void ring_pool_put(ring_pool* pool, char* msg, int cap)
+{
+    int c = ring_pool_class(cap);
+    pool->released = 1;
+    if (c >= 0 && pool->free_num[c] < RING_POOL_SLOTS)  {
+        pool->free[c][pool->free_num[c]++] = msg;
+        return;
+    }
+    ring_buffer_unmap(msg, cap);
+    pool->mapped_bytes -= cap;
+}
+
+/* 内存还给pool或者系统，之后不占内存 */
+static void ring_buffer_detach(ring_buffer* rb)
+{
+    if (rb->msg == NULL)  {
+        return;
+    }
+    if (rb->borrowed)  {
+        //借用的外部内存，不归自己释放
+    }
+    else if (!rb->mirrored)  {
         mu_free(rb->msg);
+        if (rb->pool)  {
+            rb->pool->mapped_bytes -= rb->cap;
+            rb->pool->released = 1;
+        }
+    }
+    else if (rb->pool)  {
+        ring_pool_put(rb->pool, rb->msg, rb->cap);
+    }
+    else  {
+        ring_buffer_unmap(rb->msg, rb->cap);
+    }
+    rb->msg = NULL;
+    rb->cap = 0;
+    rb->mirrored = 0;
+    rb->borrowed = 0;
+    rb->start = rb->end = 0;
+}
+
+/* 换一块至少能放下need字节的内存，已有的数据搬过去；pool到达上限且不是force时返回-1 */
+static int ring_buffer_grow(ring_buffer* rb, int need, int force)
+{
+    int cap = rb->cap > 0 && !rb->borrowed ? rb->cap * 2 : ring_buffer_base_cap();
+    while (cap < need)  {
+        cap *= 2;
+    }
+
+    int mirrored = 1;
+    char* msg = NULL;
+    if (rb->pool)  {
+        if (!force && ring_pool_full(rb->pool, cap))  {
+            return -1;
+        }
+        msg = ring_pool_get(rb->pool, cap);
+    }
+    else  {
+        msg = ring_buffer_map(cap);
+    }
+    if (msg == NULL)  {
+        debug_msg("map ring buffer failed, falls back to malloc, file: %s, line: %d", __FILE__, __LINE__);
+        mirrored = 0;
+        msg = (char*)mu_malloc(MEM_TAG_BUFFER, cap);
+        if (msg == NULL)  {
+            return -1;
+        }
+        if (rb->pool)  {
+            rb->pool->mapped_bytes += cap;
+        }
+    }
+
+    int used = rb->end - rb->start;
+    if (used > 0)  {
+        memcpy(msg, rb->msg + rb->start, used);
+    }
+    ring_buffer_detach(rb);      //借用的内存只是不再指向它
+    rb->msg = msg;
+    rb->cap = cap;
+    rb->mirrored = mirrored;
+    rb->start = 0;
+    rb->end = used;
+    return 0;
+}
+
+
+void ring_buffer_free(ring_buffer* rb)
+{
+    ring_buffer_detach(rb);
+    mu_free(rb);
+}
+
+void ring_buffer_clear(ring_buffer* rb)
+{
+    ring_buffer_detach(rb);
+}
+
+/* 读socket之前调用，保证有可写的空间；pool到达上限时返回-1，这时应该先不读，数据留在内核里 */
+int ring_buffer_reserve(ring_buffer* rb)
+{
+    if (rb->msg && ring_buffer_available_bytes(rb) > 0)  {
+        return 0;
+    }
+    return ring_buffer_grow(rb, rb->end - rb->start + 1, 0);
+}
+
+/* 缓冲区为空时直接使用外部的内存，前len字节是已有的数据，解析时不用复制；
+   外部内存失效之前要调用ring_buffer_own */
+void ring_buffer_borrow(ring_buffer* rb, char* data, int len, int cap)
+{
+    ring_buffer_detach(rb);
+    rb->msg = data;
+    rb->cap = cap;
+    rb->borrowed = 1;
+    rb->start = 0;
+    rb->end = len;
+}
+
+/* 不再使用借来的内存，没处理完的数据复制到自己的缓冲区里 */
+void ring_buffer_own(ring_buffer* rb)
+{
+    if (!rb->borrowed)  {
+        return;
+    }
+    if (rb->end == rb->start)  {
+        ring_buffer_detach(rb);
+    }
+    else  {
+        ring_buffer_grow(rb, rb->end - rb->start, 1);     //数据已经读出来了，不能丢
     }
 }
 
@@ -23,34 +285,18 @@ void ring_buffer_free(ring_buffer* rb)
 void ring_buffer_push_data(ring_buffer* rb, char* msg, int size)
 {
     int used = rb->end - rb->start;
-    int available = rb->cap - used;
-    if (available < size)  {          //可用数据不足了
-        if (rb->start > size)  {      //可以塞前面
-            memmove(rb->msg, rb->msg + rb->start, used);
-            rb->start = 0;
-            memcpy(rb->msg + used, msg, size);
-            rb->end = used + size;
+    if (rb->borrowed || rb->cap - used < size)  {          //可用空间不足了，只有这时才搬数据
+        if (ring_buffer_grow(rb, used + size, 1) < 0)  {     //数据已经读出来了，不能丢
+            return;
         }
-        else  {
-            rb->cap = rb->cap * 2 + size;
-            char* new_msg = (char*)mu_malloc(rb->cap);
-            if (used > 0 )  {
-                memcpy(new_msg, rb->msg + rb->start, used);
-            }
-            memcpy(new_msg + used, msg, size);
-            if (rb->msg)  {    //刚开始非空
-                mu_free(rb->msg);
-            }
-            rb->msg = new_msg;
-            rb->start = 0;
-            rb->end = size + used;
-        }
-        
     }
-    else  {
-        memcpy(rb->msg + rb->end, msg, size);
-        rb->end += size;
+    else if (!rb->mirrored && rb->end + size > rb->cap)  {      //没有映射两次，后面放不下要挪到前面
+        memmove(rb->msg, rb->msg + rb->start, used);
+        rb->start = 0;
+        rb->end = used;
     }
+    memcpy(rb->msg + rb->end, msg, size);
+    rb->end += size;
 }
 
 
@@ -61,6 +307,12 @@ char* ring_buffer_readable_start(ring_buffer* rb)
     return rb->msg + rb->start;
 }
 
+/* 接着可读数据之后，长度是ring_buffer_available_bytes，写入后end加上写入的长度 */
+char* ring_buffer_writable_start(ring_buffer* rb)
+{
+    return rb->msg + rb->end;
+}
+
 char* ring_buffer_get_msg(ring_buffer* rb, int* len)
 {
     char* msg = rb->msg + rb->start;
@@ -83,16 +335,23 @@ int ring_buffer_readable_bytes(ring_buffer* rb)
 
 int ring_buffer_available_bytes(ring_buffer* rb)
 {
+    if (rb->mirrored)  {
+        return rb->cap - (rb->end - rb->start);
+    }
     return rb->cap - rb->end;
 }
 
 void ring_buffer_release_bytes(ring_buffer* rb, int size)
 {
-    if (rb->msg + rb->start)  {
-        memset(rb->msg + rb->start, 0, size);
-    }
     rb->start += size;
     if (rb->start == rb->end)  {
+        if (rb->pool || rb->borrowed)  {
+            ring_buffer_detach(rb);      //读完了，内存还给pool
+        }
         rb->start = rb->end = 0;
     }
-}
\ No newline at end of file
+    else if (rb->start >= rb->cap)  {      //读到了第二份映射里，换回第一份的地址
+        rb->start -= rb->cap;
+        rb->end -= rb->cap;
+    }
+}
@@ -1,18 +1,48 @@
 #pragma once
 
+typedef struct ring_pool_t ring_pool;
+
+/* 固定容量的环形缓冲区，同一块内存在虚拟地址上连续映射两次，
+   所以可读的数据和可写的空间总是连续的，不用挪动数据；放不下时才换一个两倍大的 */
 struct ring_buffer_t   {
-    int start;
-    int end;
+    int start;        //[0, cap)
+    int end;          //start + 可读字节数，可能超过cap，落在第二份映射里
     int cap;
-    
-    char* msg;
+    int mirrored;     //映射失败时退回普通的malloc，满了要把数据挪到前面
+    int borrowed;     //msg指向外部的内存(loop的接收缓冲区、io_uring的缓冲区)，不能长期持有
+
+    char* msg;        //数据读完后还给pool，空闲的连接不占内存
+    ring_pool* pool;  //为NULL时自己映射和释放
+
+};
 
+#define RING_POOL_CLASSES 6      //RING_BUFFER_SIZE到它的32倍，更大的不缓存
+#define RING_POOL_SLOTS   64     //每种大小最多缓存的空闲映射数
+
+/* 每个loop一个，只在loop线程中使用；按大小分类缓存映射好的内存，定时释放一直没用上的 */
+struct ring_pool_t  {
+    char* free[RING_POOL_CLASSES][RING_POOL_SLOTS];
+    int free_num[RING_POOL_CLASSES];
+    int low[RING_POOL_CLASSES];   //上次收缩以来空闲数的最低值，这么多一直没用上
+    long mapped_bytes;            //借出去的和空闲的总共占的内存
+    long limit_bytes;             //超过后不再借出新的缓冲区，连接暂停读取
+    int released;                 //有内存还回来了，loop据此唤醒暂停读取的连接后清零
 };
 
 typedef struct ring_buffer_t ring_buffer;
 
-ring_buffer* ring_buffer_new();
+ring_pool* ring_pool_create(long limit_bytes);
+void ring_pool_free(ring_pool* pool);
+void ring_pool_shrink(ring_pool* pool);
+
+ring_buffer* ring_buffer_new(ring_pool* pool);
 void ring_buffer_free(ring_buffer* rb);
+void ring_buffer_init(ring_buffer* rb, ring_pool* pool);
+void ring_buffer_clear(ring_buffer* rb);
+
+int ring_buffer_reserve(ring_buffer* rb);
+void ring_buffer_borrow(ring_buffer* rb, char* data, int len, int cap);
+void ring_buffer_own(ring_buffer* rb);
 
 void ring_buffer_push_data(ring_buffer* rb, char* msg, int size);
 
@@ -20,6 +50,8 @@ void ring_buffer_push_data(ring_buffer* rb, char* msg, int size);
 
 char* ring_buffer_readable_start(ring_buffer* rb);
 
+char* ring_buffer_writable_start(ring_buffer* rb);
+
 int ring_buffer_readable_bytes(ring_buffer* rb);
 
 void ring_buffer_release_bytes(ring_buffer* rb, int size);
@@ -2,23 +2,44 @@
 #include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <string.h>
+#include <time.h>
 #include "servermanager.h"
 #include "event_loop.h"
+#include "event.h"
 #include "epoll.h"
 #include "config.h"
 #include "timer.h"
+#include "connection.h"
+#include "affinity.h"
+#include "buffer_chain.h"
 #include "misc/logger.h"
 
-event_loop *g_loops[MAX_LOOP];
+event_loop **g_loops;
 
 int started_loop = 0;
 pthread_spinlock_t lock;
 
+static int* loop_cpus;       //第i个工作线程绑定到loop_cpus[i % loop_cpu_num]
+static int loop_cpu_num;
+
 void* spawn_thread(void *arg)
 {
 	int i = (long)arg;
+    int cpu = -1;
+    if (loop_cpu_num > 0)  {           //先绑核再创建loop，loop的内存都从本节点分配
+        cpu = loop_cpus[i % loop_cpu_num];
+        if (affinity_bind_cpu(cpu) == 0)  {
+            affinity_local_memory();
+        }
+    }
 	g_loops[i] = event_loop_create();
+    if (g_loops[i] == NULL)  {           //主线程在等所有loop启动，没法继续
+        debug_quit("create event loop of worker %d failed, file: %s, line: %d", i, __FILE__, __LINE__);
+    }
+    g_loops[i]->index = i;
+    g_loops[i]->cpu = cpu;
+    g_loops[i]->numa_node = cpu >= 0 ? cpu_numa_node(cpu) : -1;
     pthread_spin_lock(&lock);
     started_loop++;
     pthread_spin_unlock(&lock);
@@ -28,15 +49,55 @@ void* spawn_thread(void *arg)
 }
 
 
-server_manager* server_manager_create(int port, int thread_num)
+static void server_manager_set_cpus(const char* cpu_list, int thread_num)
+{
+    loop_cpu_num = 0;
+    if (cpu_list == NULL || thread_num == 0)  {
+        return;
+    }
+
+    int max = cpu_online_num() * 4 + 64;
+    loop_cpus = (int*)mu_malloc(MEM_TAG_MISC, sizeof(int) * max);
+    if (loop_cpus == NULL)  {
+        debug_msg("alloc cpu list failed, worker threads are not pinned, file: %s, line: %d", __FILE__, __LINE__);
+        return;
+    }
+    int num = cpu_list_parse(cpu_list, loop_cpus, max);
+    if (num <= 0)  {
+        debug_msg("invalid cpu list %s, worker threads are not pinned", cpu_list);
+        return;
+    }
+    cpu_list_spread_nodes(loop_cpus, num);
+    loop_cpu_num = num;
+
+    int node = cpu_numa_node(loop_cpus[0]);      //accept所在的主线程和第一个工作线程放在同一个节点上
+    if (node >= 0 && affinity_bind_node(node) == 0)  {
+        affinity_local_memory();
+    }
+}
+
+server_manager* server_manager_create(int port, int thread_num, const char* cpu_list)
 {
     pthread_spin_init(&lock, PTHREAD_PROCESS_PRIVATE);
-    server_manager* manager = (server_manager*)malloc(sizeof(server_manager));
+    server_manager* manager = (server_manager*)mu_malloc(MEM_TAG_MISC, sizeof(server_manager));
     if (manager == NULL)  {
 		debug_ret("create server_manager failed, file: %s, line: %d", __FILE__, __LINE__);
 		return NULL;
 	}
 	manager->listen_port = port;
+    manager->reuse_port = 0;
+    manager->accept_budget = ACCEPT_BUDGET;
+    manager->dispatch_policy = DISPATCH_ROUND_ROBIN;
+    manager->dispatch_seed = (unsigned int)time(NULL);
+    manager->dispatch_next = 0;
+    manager->rebalance_snapshot = NULL;
+    manager->busy_poll_socket = 0;
+    manager->stats_interval = 0;
+
+    if (thread_num < 0) {         //默认每个在线的cpu一个工作线程
+        thread_num = cpu_online_num();
+    }
+    server_manager_set_cpus(cpu_list, thread_num);      //先把主线程绑到节点上，accept的loop的内存从这个节点分配
 
     manager->loop = event_loop_create();
     if (manager->loop == NULL)  {
@@ -47,10 +108,9 @@ server_manager* server_manager_create(int port, int thread_num)
 
     signal(SIGPIPE, SIG_IGN);
 
-    if (thread_num < 0 || thread_num > MAX_LOOP) {
-        thread_num = MAX_LOOP;
-    }
     manager->loop_num = thread_num;
+    g_loops = (event_loop**)mu_malloc(MEM_TAG_MISC, sizeof(event_loop*) * (thread_num > 0 ? thread_num : 1));
+
     pthread_t tid;
     long long i = 0;
 	for (i = 0; i < thread_num; i++)  {
@@ -67,74 +127,191 @@ server_manager* server_manager_create(int port, int thread_num)
     }
 
     pthread_spin_destroy(&lock);
-    manager->timer_manager = timer_manager_create();
+    if (thread_num > 0)  {           //连接都在工作线程上，主线程只accept和跑定时器，不需要忙等
+        manager->loop->busy_poll_us = 0;
+    }
 	
 	return manager;
 }
 
-void server_manager_time_event(server_manager* manager, int timeout)
+/* 定时器在主线程的loop上执行 */
+timer* server_manager_add_timer(server_manager* manager, int time_out, enum TimerOptions type, timeout_callback_pt callback, void* arg)
 {
-    timer_manager* tm = manager->timer_manager;
-    if (!tm || tm->size <= 0)  {
-        return;
-    }
+    return event_loop_add_timer(manager->loop, time_out, type, callback, arg);
+}
 
-    timer_manager_update(tm, timeout);
+void server_manager_cancel_timer(server_manager* manager, timer* t)
+{
+    event_loop_cancel_timer(manager->loop, t);
+}
 
-    timer* top = tm->top;
-    while(top->time_left <= 0)  {
-        timer ti = timer_manager_pop(tm);
-        if (ti.type == TIMER_OPT_ONCE)  {
-            ti.callback(ti.arg);
-        }
-        else if (ti.type == TIMER_OPT_REPEAT)  {
-            server_manager_add_timer(manager, ti);
-            ti.callback(ti.arg);
-        }
-        top = tm->top;
-    }
+
+void server_manager_run(server_manager* manager)
+{
+    event_loop_run(manager->loop);
 }
 
 
-bool calc_timeout(server_manager* manager, int* timeout)
+static long loop_load(event_loop* loop, int policy)
 {
-    timer_manager* tm = manager->timer_manager;
-    if (tm && tm->size > 0 && tm->top)  {
-        *timeout = tm->top->time_left;
-        return true;
+    if (policy == DISPATCH_LEAST_BYTES)  {
+        return __atomic_load_n(&loop->pending_bytes, __ATOMIC_RELAXED);
     }
-    *timeout = -1;
-    return false;
+    return __atomic_load_n(&loop->conn_num, __ATOMIC_RELAXED)
+         + __atomic_load_n(&loop->pending_conns, __ATOMIC_RELAXED);
 }
 
+/* 在accept的线程中调用，选中的loop的pending_conns加1，由它接管连接后减掉 */
+event_loop* server_manager_pick_loop(server_manager* manager)
+{
+    int num = manager->loop_num;
+    if (num == 0)  {     //如果没有开启线程则用主线程的
+        return manager->loop;
+    }
+
+    int idx = 0;
+    int i;
+    switch (manager->dispatch_policy)  {
+    case DISPATCH_LEAST_CONN:
+    case DISPATCH_LEAST_BYTES:  {
+        long min = -1;
+        for (i = 0; i < num; i++)  {       //从上次的位置开始找，负载相同时不总是落在第一个loop上
+            int k = (manager->dispatch_next + i) % num;
+            long load = loop_load(g_loops[k], manager->dispatch_policy);
+            if (min < 0 || load < min)  {
+                min = load;
+                idx = k;
+            }
+        }
+        manager->dispatch_next = (idx + 1) % num;
+        break;
+    }
+    case DISPATCH_TWO_CHOICES:  {
+        int a = rand_r(&manager->dispatch_seed) % num;
+        int b = rand_r(&manager->dispatch_seed) % num;
+        idx = loop_load(g_loops[b], DISPATCH_LEAST_CONN) < loop_load(g_loops[a], DISPATCH_LEAST_CONN) ? b : a;
+        break;
+    }
+    default:
+        if (manager->dispatch_next >= num)
+            manager->dispatch_next = 0;
+        idx = manager->dispatch_next++;
+        break;
+    }
 
-void server_manager_add_timer(server_manager* manager, timer ti)
+    __atomic_add_fetch(&g_loops[idx]->pending_conns, 1, __ATOMIC_RELAXED);
+    return g_loops[idx];
+}
+
+int dispatch_policy_from_name(const char* name)
 {
-    timer_manager* tm = manager->timer_manager;
-    if (!tm)  {
-        return ;
+    if (strcmp(name, "conn") == 0)  {
+        return DISPATCH_LEAST_CONN;
+    }
+    else if (strcmp(name, "bytes") == 0)  {
+        return DISPATCH_LEAST_BYTES;
+    }
+    else if (strcmp(name, "p2c") == 0)  {
+        return DISPATCH_TWO_CHOICES;
+    }
+    else if (strcmp(name, "rr") == 0)  {
+        return DISPATCH_ROUND_ROBIN;
     }
+    return -1;
+}
+
+
+typedef struct rebalance_req_t  {
+    loop_task task;
+    event_loop* to;
+    int load;
+} rebalance_req;
 
-    timer_manager_push(tm, ti);
+static void rebalance_in_loop(event_loop* loop, void* arg)      //in the busy loop thread
+{
+    rebalance_req* req = (rebalance_req*)arg;
+    connection_migrate_busy(loop, req->to, req->load);
+    mu_free(req);
 }
 
+/* 定时比较各loop这段时间处理的可读事件数，最忙的比最闲的多一倍以上时让它把一部分空闲连接迁过去 */
+static void server_manager_rebalance(void* arg)
+{
+    server_manager* manager = (server_manager*)arg;
+    int busy = 0;
+    int idle = 0;
+    long busy_load = -1;
+    long idle_load = -1;
+    int i;
+    for (i = 0; i < manager->loop_num; i++)  {
+        long count = __atomic_load_n(&g_loops[i]->read_count, __ATOMIC_RELAXED);
+        long load = count - manager->rebalance_snapshot[i];
+        manager->rebalance_snapshot[i] = count;
+        if (busy_load < 0 || load > busy_load)  {
+            busy_load = load;
+            busy = i;
+        }
+        if (idle_load < 0 || load < idle_load)  {
+            idle_load = load;
+            idle = i;
+        }
+    }
 
+    if (busy == idle || busy_load < REBALANCE_MIN_LOAD || busy_load <= idle_load * 2)  {
+        return;
+    }
 
-void server_manager_run(server_manager* manager)
+    rebalance_req* req = (rebalance_req*)mu_malloc(MEM_TAG_MISC, sizeof(rebalance_req));
+    if (req == NULL)  {
+        return;
+    }
+    req->to = g_loops[idle];
+    req->load = (busy_load - idle_load) / 2;
+    req->task.callback = rebalance_in_loop;
+    req->task.arg = req;
+    event_loop_post(g_loops[busy], &req->task);
+}
+
+void server_manager_enable_rebalance(server_manager* manager, int interval)
 {
-    int timeout = -1;
-    while(1)  {
-        bool has_timeout = calc_timeout(manager, &timeout);
+    if (interval <= 0 || manager->loop_num < 2 || manager->rebalance_snapshot)  {
+        return;
+    }
+    manager->rebalance_snapshot = (long*)mu_malloc(MEM_TAG_MISC, sizeof(long) * manager->loop_num);
+    memset(manager->rebalance_snapshot, 0, sizeof(long) * manager->loop_num);
 
-        struct timeval now;
-        gettimeofday(&now, NULL);
-        struct timeval trigger_time = epoller_dispatch(manager->loop->epoll_fd, timeout);       //
+    server_manager_add_timer(manager, interval, TIMER_OPT_REPEAT, server_manager_rebalance, manager);
+}
 
-        int64_t diff = (trigger_time.tv_sec - now.tv_sec) * 1000 * 1000 + (trigger_time.tv_usec - now.tv_usec);
-        timeout = diff / 1000;
 
-        if (has_timeout)  {
-            server_manager_time_event(manager, timeout);         //已经过去了多少毫秒
-        }
+/* 定时打印各loop的状态，用来判断事件数组等参数是否合适 */
+static void server_manager_report(void* arg)
+{
+    server_manager* manager = (server_manager*)arg;
+    int i;
+    for (i = 0; i < manager->loop_num; i++)  {
+        event_loop* loop = g_loops[i];
+        debug_msg("loop %d: conns %d, events %d, events full %ld, spin %ldms (%ld hits), block %ldms (%ld wakeups), "
+                  "buffer nodes %d in %d regions (%d hugetlb)",
+                  i, __atomic_load_n(&loop->conn_num, __ATOMIC_RELAXED),
+                  __atomic_load_n(&loop->events_cap, __ATOMIC_RELAXED),
+                  __atomic_load_n(&loop->events_full, __ATOMIC_RELAXED),
+                  __atomic_load_n(&loop->spin_us, __ATOMIC_RELAXED) / 1000,
+                  __atomic_load_n(&loop->spin_hits, __ATOMIC_RELAXED),
+                  __atomic_load_n(&loop->block_us, __ATOMIC_RELAXED) / 1000,
+                  __atomic_load_n(&loop->block_wakeups, __ATOMIC_RELAXED),
+                  __atomic_load_n(&loop->chunk_pool->node_used, __ATOMIC_RELAXED),
+                  __atomic_load_n(&loop->chunk_pool->region_num, __ATOMIC_RELAXED),
+                  __atomic_load_n(&loop->chunk_pool->huge_regions, __ATOMIC_RELAXED));
+    }
+    mem_stats_log(manager->stats_interval);
+}
+
+void server_manager_enable_stats(server_manager* manager, int interval)
+{
+    if (interval <= 0)  {
+        return;
     }
-}
\ No newline at end of file
+    manager->stats_interval = interval;
+    server_manager_add_timer(manager, interval, TIMER_OPT_REPEAT, server_manager_report, manager);
+}
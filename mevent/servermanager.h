@@ -8,31 +8,49 @@ typedef void (*message_callback_pt)(connection *conn);
 
 typedef struct event_loop_t event_loop;
 
-typedef struct timer_ timer;
-
-typedef struct timer_manager_t timer_manager;
+#include "timer.h"
+
+/* 主线程accept后把连接分派给哪个loop */
+enum DispatchPolicy  {
+    DISPATCH_ROUND_ROBIN,     //轮流
+    DISPATCH_LEAST_CONN,      //连接数最少
+    DISPATCH_LEAST_BYTES,     //写缓冲区积压字节最少
+    DISPATCH_TWO_CHOICES,     //随机取两个，选连接数少的
+};
 
 
 struct server_manager_t {
     int epoll_fd;
     int listen_port;
     int loop_num;
+    int reuse_port;       //每个工作线程用SO_REUSEPORT打开自己的监听socket
+    int accept_budget;    //一次唤醒最多accept的连接数
+    int dispatch_policy;  //enum DispatchPolicy
+    unsigned int dispatch_seed;
+    int dispatch_next;    //round robin的下一个loop
+    long* rebalance_snapshot;  //上次检查时各loop的read_count
+    int busy_poll_socket;      //新连接设置SO_BUSY_POLL，时间和loop的busy_poll_us一样
+    int stats_interval;        //打印统计的间隔，毫秒，用来算每秒的分配次数
 
     event_loop* loop;
 
     connection_callback_pt new_connection_callback;
     message_callback_pt msg_callback;
-
-    timer_manager* timer_manager;
 };
 
 
 typedef struct server_manager_t server_manager;
 
 
-server_manager* server_manager_create(int port, int thread_num);
+server_manager* server_manager_create(int port, int thread_num, const char* cpu_list);
 void server_manager_run(server_manager* manager);
 
-void server_manager_add_timer(server_manager* manager, timer ti);
+timer* server_manager_add_timer(server_manager* manager, int time_out, enum TimerOptions type, timeout_callback_pt callback, void* arg);
+void server_manager_cancel_timer(server_manager* manager, timer* t);
+
+event_loop* server_manager_pick_loop(server_manager* manager);
+void server_manager_enable_rebalance(server_manager* manager, int interval);
+void server_manager_enable_stats(server_manager* manager, int interval);
+int dispatch_policy_from_name(const char* name);
 
  
\ No newline at end of file
@@ -0,0 +1,71 @@
+#include <string.h>
+#include <stdlib.h>
+#include "slab.h"
+#include "config.h"
+
+#include "misc/logger.h"
+
+slab_cache* slab_create(size_t size, int max_free)
+{
+    slab_cache* s = (slab_cache*)mu_malloc(MEM_TAG_CONN, sizeof(slab_cache));
+    if (s == NULL)  {
+        debug_ret("create slab failed, file: %s, line: %d", __FILE__, __LINE__);
+        return NULL;
+    }
+    s->size = (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    s->free_list = NULL;
+    s->free_num = 0;
+    s->low = 0;
+    s->max_free = max_free;
+    return s;
+}
+
+/* 从空闲链表上释放n个对象 */
+static void slab_release(slab_cache* s, int n)
+{
+    while (n-- > 0 && s->free_list)  {
+        void* obj = s->free_list;
+        s->free_list = *(void**)obj;
+        s->free_num--;
+        mu_free(obj);
+    }
+}
+
+void slab_destroy(slab_cache* s)
+{
+    if (s)  {
+        slab_release(s, s->free_num);
+        mu_free(s);
+    }
+}
+
+void* slab_alloc(slab_cache* s)
+{
+    void* obj = s->free_list;
+    if (obj)  {
+        s->free_list = *(void**)obj;
+        if (--s->free_num < s->low)  {
+            s->low = s->free_num;
+        }
+        return obj;
+    }
+    return mem_alloc_aligned(MEM_TAG_CONN, CACHE_LINE_SIZE, s->size);
+}
+
+void slab_free(slab_cache* s, void* obj)
+{
+    if (s->free_num >= s->max_free)  {
+        mu_free(obj);
+        return;
+    }
+    *(void**)obj = s->free_list;
+    s->free_list = obj;
+    s->free_num++;
+}
+
+/* 定时调用，上个周期里一直空闲的对象还给系统 */
+void slab_shrink(slab_cache* s)
+{
+    slab_release(s, s->low);
+    s->low = s->free_num;
+}
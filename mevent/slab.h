@@ -0,0 +1,23 @@
+#pragma once
+#include <stddef.h>
+
+/* 固定大小对象的缓存，对象按cache line对齐，释放的对象挂在空闲链表上下次直接复用；
+   每个loop一个，只在loop线程中使用，不加锁 */
+
+typedef struct slab_cache_t slab_cache;
+
+struct slab_cache_t  {
+    size_t size;          //对象大小，已向上取整到CACHE_LINE_SIZE的倍数
+    void* free_list;      //空闲对象的头几个字节存放下一个空闲对象
+    int free_num;
+    int low;              //上次收缩以来free_num的最低值，这么多对象一直没用上
+    int max_free;         //最多缓存的空闲对象数，多出来的直接释放
+};
+
+
+slab_cache* slab_create(size_t size, int max_free);
+void slab_destroy(slab_cache* s);
+
+void* slab_alloc(slab_cache* s);
+void slab_free(slab_cache* s, void* obj);
+void slab_shrink(slab_cache* s);
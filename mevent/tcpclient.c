@@ -16,7 +16,7 @@
 
 tcpclient* tcpclient_create(const char* ip, short port)
 {
-    tcpclient* cli = (tcpclient*)mu_malloc(sizeof(tcpclient));
+    tcpclient* cli = (tcpclient*)mu_malloc(MEM_TAG_CONN, sizeof(tcpclient));
     int socket_fd = socket(AF_INET, SOCK_STREAM, 0);  
     if (socket_fd < 0)  {
         debug_ret("create socket failed, file: %s, line: %d", __FILE__, __LINE__);
@@ -1,195 +1,337 @@
-
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 #include "timer.h"
 #include "config.h"
 
 
-timer_manager* timer_manager_create()
+#define TIMER_ROOT_MASK   (TIMER_ROOT_SIZE - 1)
+#define TIMER_LEVEL_MASK  (TIMER_LEVEL_SIZE - 1)
+#define TIMER_MAX_DELTA   ((1LL << (TIMER_ROOT_BITS + TIMER_LEVELS * TIMER_LEVEL_BITS)) - 1)
+
+enum TimerState  {
+    TIMER_FREE,
+    TIMER_PENDING,        //在时间轮的某个槽里
+    TIMER_RUNNING,        //正在执行回调
+    TIMER_CANCELLED,      //在自己的回调中被取消，回调返回后回收
+};
+
+struct timer_  {
+    int64_t expire;          //到期的绝对时间，毫秒
+    int time_out;            //单位毫秒
+    enum TimerOptions type;
+    timeout_callback_pt callback;
+    void* arg;
+
+    int state;
+    int level;               //-1在第一层，否则是levels的下标
+    timer** slot;            //所在的槽，取消时O(1)摘下
+    timer* prev;
+    timer* next;
+};
+
+
+int64_t timer_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+timer_manager* timer_manager_create(int slack)
 {
     int size = sizeof(timer_manager);
-    timer_manager* m = (timer_manager*)mu_malloc(size);
+    timer_manager* m = (timer_manager*)mu_malloc(MEM_TAG_TIMER, size);
     if (NULL == m)  {
         return NULL;
     }
 
     memset(m, 0, size);
-    m->cap = MAX_TIMER_EVENT;
-
-    m->queue0 = (timer**)mu_malloc(size * m->cap);
-    m->queue1 = (timer**)mu_malloc(size * m->cap);
-    memset(m->queue0, 0, size * m->cap);
-    memset(m->queue1, 0, size * m->cap);
+    m->slack = slack > 1 ? slack : 1;
+    m->current = timer_now();
+    m->now = m->current;
+    m->next = INT64_MAX;
     return m;
 }
 
+static void timer_free_list(timer* t)
+{
+    while (t)  {
+        timer* next = t->next;
+        mu_free(t);
+        t = next;
+    }
+}
+
 void timer_manager_free(timer_manager* m)
 {
     if (m)  {
-        timer** queue = m->queue0;
-        if (m->index == 1)  {
-            queue = m->queue1;
+        int i, j;
+        for (i = 0; i < TIMER_ROOT_SIZE; i++)  {
+            timer_free_list(m->root[i]);
         }
-        int i = 0;
-        for (; i < m->cap ; i++)  {
-            if (queue[i])  {
-                mu_free(queue[i]);
-            }
-            else  {
-                break;
+        for (i = 0; i < TIMER_LEVELS; i++)  {
+            for (j = 0; j < TIMER_LEVEL_SIZE; j++)  {
+                timer_free_list(m->levels[i][j]);
             }
         }
-
-        if(m->queue0) mu_free(m->queue0);
-        if(m->queue1) mu_free(m->queue1);
+        timer_free_list(m->free_list);
+        mu_free(m);
     }
 }
 
 
-timer* timer_new(int utime)
+static int64_t timer_expire_at(timer_manager* m, int64_t now, int time_out)
 {
-    timer* t = (timer*)malloc(sizeof(timer));
-    memset(t, 0, sizeof(timer));
-    t->time_out = utime;
-    return t;
+    int64_t expire = now + (time_out > 0 ? time_out : 0);
+    if (m->slack > 1)  {
+        expire = (expire + m->slack - 1) / m->slack * m->slack;
+    }
+    return expire;
 }
 
-
-void timer_manager_push(timer_manager* manager, timer ti)
+static void timer_link(timer_manager* m, timer* t)
 {
-    int size = manager->size;
-    if (size >= manager->cap)  {
-        timer** temp0 = manager->queue0;
-        timer** temp1 = manager->queue1;
-        int size_of_ptr = sizeof(timer*);
-        manager->queue0 = (timer**)mu_malloc(size_of_ptr * manager->cap * 2);
-        manager->queue1 = (timer**)mu_malloc(size_of_ptr * manager->cap * 2);
-
-        memset(manager->queue0, 0, size_of_ptr * manager->cap * 2);
-        memset(manager->queue1, 0, size_of_ptr * manager->cap * 2);
+    int64_t expire = t->expire < m->current ? m->current : t->expire;
+    int64_t delta = expire - m->current;
+    timer** slot;
 
-        //memcpy(manager->queue0, temp0, manager->cap);
-        //memcpy(manager->queue1, temp1, manager->cap);
-
-        if (manager->index == 0)  {
-            int i = 0;
-            for (; i < manager->size; i++)  {
-                manager->queue0[i] = temp0[i];
-            }
+    if (delta < TIMER_ROOT_SIZE)  {
+        slot = &m->root[expire & TIMER_ROOT_MASK];
+        t->level = -1;
+        m->root_size++;
+    }
+    else  {
+        if (delta > TIMER_MAX_DELTA)  {       //超出时间轮的范围，先放在最高层，转到那里时再重新放
+            expire = m->current + TIMER_MAX_DELTA;
+            delta = TIMER_MAX_DELTA;
         }
-        else  {
-            int i = 0;
-            for (; i < manager->size; i++)  {
-                manager->queue1[i] = temp1[i];
-            }
+        int level = 0;
+        while (delta >= (1LL << (TIMER_ROOT_BITS + (level + 1) * TIMER_LEVEL_BITS)))  {
+            level++;
         }
+        int shift = TIMER_ROOT_BITS + level * TIMER_LEVEL_BITS;
+        slot = &m->levels[level][(expire >> shift) & TIMER_LEVEL_MASK];
+        t->level = level;
+    }
 
-        mu_free(temp0);
-        mu_free(temp1);
-        manager->cap *= 2;
-    }
-    ti.time_left = ti.time_out;
-    timer* pti = (timer*)mu_malloc(sizeof(timer));
-    *pti = ti;
-    if (manager->top)  {   
-        if (pti->time_left < manager->top->time_left)  {   //替换最小的
-            manager->top = pti;
-            manager->top_index = size;
-        }
+    t->slot = slot;
+    t->prev = NULL;
+    t->next = *slot;
+    if (*slot)  {
+        (*slot)->prev = t;
+    }
+    *slot = t;
+    t->state = TIMER_PENDING;
+    m->size++;
+
+    if (t->expire < m->next)  {        //到期时一路处理过来，中间的层自然会转下来
+        m->next = t->expire;
+    }
+}
+
+static void timer_unlink(timer_manager* m, timer* t)
+{
+    if (t->prev)  {
+        t->prev->next = t->next;
     }
     else  {
-        manager->top = pti;
+        *t->slot = t->next;
     }
+    if (t->next)  {
+        t->next->prev = t->prev;
+    }
+    if (t->level < 0)  {
+        m->root_size--;
+    }
+    t->prev = t->next = NULL;
+    t->slot = NULL;
+    m->size--;
+}
 
-    if (manager->index == 0)  {
-        manager->queue0[manager->size++] = pti;
+static void timer_release(timer_manager* m, timer* t)
+{
+    t->state = TIMER_FREE;
+    t->callback = NULL;
+    t->arg = NULL;
+    t->next = m->free_list;
+    m->free_list = t;
+}
+
+
+timer* timer_manager_add(timer_manager* m, int time_out, enum TimerOptions type, timeout_callback_pt callback, void* arg)
+{
+    timer* t = m->free_list;
+    if (t)  {
+        m->free_list = t->next;
     }
     else  {
-        manager->queue1[manager->size++] = pti;
+        t = (timer*)mu_malloc(MEM_TAG_TIMER, sizeof(timer));
+        if (t == NULL)  {
+            return NULL;
+        }
+    }
+    memset(t, 0, sizeof(timer));
+
+    if (type == TIMER_OPT_REPEAT && time_out < 1)  {     //否则在同一个刻度里不停地重复
+        time_out = 1;
     }
+    t->time_out = time_out;
+    t->type = type;
+    t->callback = callback;
+    t->arg = arg;
+    t->expire = timer_expire_at(m, m->now, time_out);
+    timer_link(m, t);
+    return t;
 }
 
+void timer_manager_cancel(timer_manager* m, timer* t)
+{
+    if (t->state == TIMER_RUNNING)  {
+        t->state = TIMER_CANCELLED;
+    }
+    else if (t->state == TIMER_PENDING)  {
+        timer_unlink(m, t);
+        timer_release(m, t);
+    }
+}
 
-timer timer_manager_pop(timer_manager* manager)
+/* 从现在起重新计时，在自己的回调中调用也可以 */
+void timer_manager_reset(timer_manager* m, timer* t, int time_out)
 {
-    timer ti;
-    ti.time_out = 0;
-    if (manager == NULL)  {
-        return ti;
+    if (t->state == TIMER_PENDING)  {
+        timer_unlink(m, t);
     }
-    if (manager->size <= 0)  {
-        return ti;
+    if (t->type == TIMER_OPT_REPEAT && time_out < 1)  {
+        time_out = 1;
+    }
+    t->time_out = time_out;
+    t->expire = timer_expire_at(m, m->now, time_out);
+    timer_link(m, t);
+}
+
+
+/* 把一个槽中的定时器按剩余时间重新放到低层 */
+static void timer_cascade(timer_manager* m, int level, int idx)
+{
+    timer* t = m->levels[level][idx];
+    m->levels[level][idx] = NULL;
+    while (t)  {
+        timer* next = t->next;
+        m->size--;
+        timer_link(m, t);
+        t = next;
     }
-    timer ret = *manager->top;
-    if (manager->size == 1)  {
-        manager->top = NULL;
-        manager->size = 0;
-        return ret;
+}
+
+static void timer_fire(timer_manager* m, timer* t, int64_t now)
+{
+    t->state = TIMER_RUNNING;
+    if (t->type != TIMER_OPT_NONE && t->callback)  {
+        t->callback(t->arg);
     }
-    mu_free(manager->top);
-    manager->top = NULL;
-    int top_index = manager->top_index;
-    if (manager->size > 1) {
-        timer* top = NULL;
-        timer** queue0;
-        timer** queue1;
-        if (manager->index == 0)  {
-            queue0 = manager->queue0;
-            queue1 = manager->queue1;
+
+    if (t->state == TIMER_RUNNING)  {
+        if (t->type == TIMER_OPT_REPEAT)  {
+            t->expire = timer_expire_at(m, now, t->time_out);
+            timer_link(m, t);
         }
         else  {
-            queue0 = manager->queue1;
-            queue1 = manager->queue0;
+            timer_release(m, t);
         }
-        manager->index = (manager->index + 1) % 2; 
-        int i = 0;
-        int j = 0;
-        for (; i < manager->cap; i++)  {
-            if (i < manager->size)  {
-                if (i == top_index)  {
-                    continue;
-                }
-                queue1[j] = queue0[i];
-                if (top == NULL)  {
-                    top = queue0[i];
-                    manager->top_index = 0;
-                }
-                else  {
-                    if (queue0[i]->time_left < top->time_left)  {
-                        top = queue0[i];
-                        manager->top_index = j;
-                    }
-                }
-                j++; 
+    }
+    else if (t->state == TIMER_CANCELLED)  {
+        timer_release(m, t);
+    }
+}
+
+/* 处理到now为止到期的定时器 */
+void timer_manager_expire(timer_manager* m, int64_t now)
+{
+    m->now = now;
+    while (m->current <= now)  {
+        if (m->size == 0)  {
+            m->current = now + 1;
+            break;
+        }
+
+        int idx = m->current & TIMER_ROOT_MASK;
+        if (idx == 0)  {
+            int level = 0;
+            int index;
+            do  {       //低层转完一圈，把上一层对应的槽转下来
+                int shift = TIMER_ROOT_BITS + level * TIMER_LEVEL_BITS;
+                index = (m->current >> shift) & TIMER_LEVEL_MASK;
+                timer_cascade(m, level, index);
+            }  while (index == 0 && ++level < TIMER_LEVELS);
+        }
+        else if (m->root_size == 0)  {       //第一层是空的，直接跳到下一次转动
+            int64_t next = (m->current | TIMER_ROOT_MASK) + 1;
+            m->current = next <= now ? next : now + 1;
+            continue;
+        }
+
+        timer* t;
+        while ((t = m->root[idx]) != NULL)  {
+            timer_unlink(m, t);
+            if (t->expire > m->current)  {      //超出范围放在最高层的，还没到期
+                timer_link(m, t);
+                continue;
             }
-            else  {
-                queue0[i] = NULL;
-                queue1[i] = NULL;
-            }   
+            timer_fire(m, t, now);
         }
-        manager->top = top;
+        m->current++;
     }
-    manager->size -= 1;
-    return ret;
 }
 
-timer timer_manager_get_top(timer_manager* manager)
+/* 最近一次需要处理的时间的下界：第一层是准确的到期时间，上面几层是它们的槽转下来的时间 */
+static int64_t timer_next_tick(timer_manager* m)
 {
-    return *manager->top;
+    int64_t next = INT64_MAX;
+    int64_t cur = m->current;
+    int i;
+    if (m->root_size > 0)  {
+        for (i = 0; i < TIMER_ROOT_SIZE; i++)  {
+            if (m->root[(cur + i) & TIMER_ROOT_MASK])  {
+                next = cur + i;
+                break;
+            }
+        }
+    }
+    if (m->size > m->root_size)  {
+        int level;
+        for (level = 0; level < TIMER_LEVELS; level++)  {
+            int shift = TIMER_ROOT_BITS + level * TIMER_LEVEL_BITS;
+            int64_t unit = cur >> shift;
+            int d = (cur & ((1LL << shift) - 1)) == 0 ? 0 : 1;     //正好在转动点上时当前槽马上就会转
+            for (; d <= TIMER_LEVEL_SIZE; d++)  {
+                if (m->levels[level][(unit + d) & TIMER_LEVEL_MASK])  {
+                    int64_t tick = (unit + d) << shift;
+                    if (tick < next)  {
+                        next = tick;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+    return next;
 }
 
-void timer_manager_update(timer_manager* manager, int timeout)
+/* 距离下一次需要处理定时器的毫秒数，没有定时器返回-1 */
+int timer_manager_timeout(timer_manager* m, int64_t now)
 {
-    timer** queue = NULL;
-    if (manager->index == 0)  {
-        queue = manager->queue0;
+    m->now = now;
+    if (m->size == 0)  {
+        return -1;
     }
-    else  {
-        queue = manager->queue1;
+    if (m->next < m->current)  {       //缓存的已经处理过了，重新找
+        m->next = timer_next_tick(m);
     }
-
-    int i = 0;
-    for (; i < manager->size; i++)  {
-        timer* ti = queue[i];
-        ti->time_left -= timeout;
+    int64_t diff = m->next - now;
+    if (diff < 0)  {
+        return 0;
     }
+    return diff > INT_MAX ? INT_MAX : (int)diff;
 }
@@ -1,49 +1,56 @@
-#pragma once 
+#pragma once
+#include <stdint.h>
 
 
 typedef void (*timeout_callback_pt)(void *arg);
 
 
 enum TimerOptions {
-    TIMER_OPT_NONE,		// 超时不处理 
-	TIMER_OPT_ONCE,		// 超时处理一次 
-	TIMER_OPT_REPEAT	// 超时重复处理 
+    TIMER_OPT_NONE,		// 超时不处理
+	TIMER_OPT_ONCE,		// 超时处理一次
+	TIMER_OPT_REPEAT	// 超时重复处理
 };
 
 
-struct timer_  {
-    int time_out;        //单位毫秒
-    int time_left;
-    enum TimerOptions type;
-    timeout_callback_pt callback;
-    void* arg;
-};
-
+/* 定时器句柄，由timer_manager分配；TIMER_OPT_ONCE的定时器回调返回后句柄失效 */
 typedef struct timer_ timer;
 
+#define TIMER_ROOT_BITS   8
+#define TIMER_LEVEL_BITS  6
+#define TIMER_LEVELS      3
+#define TIMER_ROOT_SIZE   (1 << TIMER_ROOT_BITS)
+#define TIMER_LEVEL_SIZE  (1 << TIMER_LEVEL_BITS)
+
+/* 分层时间轮，精度1毫秒：第一层256个槽，往上三层各64个槽，约18小时，更远的到期时在最高层循环 */
 struct timer_manager_t  {
-    timer* top;
-    timer** queue0;
-    timer** queue1;
-    int index;
+    int64_t current;          //下一个要处理的毫秒
+    int64_t next;             //下一次需要处理的时间的下界，已经过去时重新计算
+    int64_t now;              //上次timeout/expire传入的时间，新加的定时器从这里开始计时，不用再读时钟
+    int slack;                //到期时间向上取整到slack的倍数，相近的定时器在同一次唤醒中处理
     int size;
-    int cap;
-    int top_index;
+    int root_size;            //第一层中的定时器个数
+
+    timer* root[TIMER_ROOT_SIZE];
+    timer* levels[TIMER_LEVELS][TIMER_LEVEL_SIZE];
+
+    timer* free_list;         //回收的句柄，避免每次malloc
 };
 
 
 typedef struct timer_manager_t timer_manager;
 
-timer_manager* timer_manager_create();
+timer_manager* timer_manager_create(int slack);
 
 void timer_manager_free(timer_manager* m);
 
-timer* timer_new(int utime);
+timer* timer_manager_add(timer_manager* m, int time_out, enum TimerOptions type, timeout_callback_pt callback, void* arg);
+
+void timer_manager_cancel(timer_manager* m, timer* t);
 
-void timer_manager_push(timer_manager* manager, timer ti);
+void timer_manager_reset(timer_manager* m, timer* t, int time_out);
 
-timer timer_manager_pop(timer_manager* manager);
+int timer_manager_timeout(timer_manager* m, int64_t now);
 
-timer timer_manager_get_top(timer_manager* manager);
+void timer_manager_expire(timer_manager* m, int64_t now);
 
-void timer_manager_update(timer_manager* manager, int timeout);
\ No newline at end of file
+int64_t timer_now();
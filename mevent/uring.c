@@ -0,0 +1,529 @@
+#define _GNU_SOURCE
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include "uring.h"
+#include "event.h"
+#include "event_loop.h"
+#include "config.h"
+#include "hugepage.h"
+
+#include "misc/logger.h"
+
+/* user_data是event指针，低3位放操作类型，event是malloc出来的，低位一定是0 */
+#define URING_OP_POLL    1
+#define URING_OP_ACCEPT  2
+#define URING_OP_RECV    3
+#define URING_OP_SEND    4
+#define URING_OP_MASK    7
+
+#define URING_BUF_GROUP  0
+#define URING_ACCEPT_RETRY_MS  100   //accept因为fd或内存不够结束时，隔这么久再重新挂上
+#define URING_MAX_RINGS  4096
+
+typedef struct uring_t  {
+    int ring_fd;
+    unsigned pending;                //已经放进提交队列还没有交给内核的个数
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    struct io_uring_sqe* sqes;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+
+    struct io_uring_buf_ring* buf_ring;     //multishot recv从这里取缓冲区，数据处理完再放回来
+    char* bufs;                             //URING_BUF_NUM * URING_BUF_SIZE，按大页映射
+    int bufs_huge;
+    unsigned short buf_tail;
+} uring;
+
+static uring* rings[URING_MAX_RINGS];      //句柄是下标，每个loop一个，只在loop自己的线程里操作
+static int ring_num = 0;
+
+
+static int sys_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+static void uring_buf_recycle(uring* r, int bid)
+{
+    struct io_uring_buf* buf = &r->buf_ring->bufs[r->buf_tail & (URING_BUF_NUM - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(r->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    r->buf_tail++;
+    __atomic_store_n(&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int uring_setup_bufs(uring* r)
+{
+    size_t size = sizeof(struct io_uring_buf) * URING_BUF_NUM;
+    r->buf_ring = (struct io_uring_buf_ring*)mem_alloc_aligned(MEM_TAG_LOOP, sysconf(_SC_PAGESIZE), size);
+    if (r->buf_ring == NULL)  {
+        return -1;
+    }
+    memset(r->buf_ring, 0, size);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)r->buf_ring;
+    reg.ring_entries = URING_BUF_NUM;
+    reg.bgid = URING_BUF_GROUP;
+    if (sys_uring_register(r->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)  {     //5.19以后才有
+        return -1;
+    }
+
+    r->bufs = (char*)hugepage_map((size_t)URING_BUF_NUM * URING_BUF_SIZE, &r->bufs_huge);
+    if (r->bufs == NULL)  {
+        return -1;
+    }
+    mem_account(MEM_TAG_LOOP, (size_t)URING_BUF_NUM * URING_BUF_SIZE);
+    int i;
+    for (i = 0; i < URING_BUF_NUM; i++)  {
+        uring_buf_recycle(r, i);
+    }
+    return 0;
+}
+
+static void uring_close(uring* r)
+{
+    if (r->sqes)  {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr)  {
+        munmap(r->cq_ptr, r->cq_size);
+    }
+    if (r->sq_ptr)  {
+        munmap(r->sq_ptr, r->sq_size);
+    }
+    if (r->ring_fd >= 0)  {
+        close(r->ring_fd);
+    }
+    if (r->buf_ring)  {
+        mu_free(r->buf_ring);
+    }
+    if (r->bufs)  {
+        hugepage_unmap(r->bufs, (size_t)URING_BUF_NUM * URING_BUF_SIZE, r->bufs_huge);
+        mem_account(MEM_TAG_LOOP, -(long)URING_BUF_NUM * URING_BUF_SIZE);
+    }
+    mu_free(r);
+}
+
+static uring* uring_open()
+{
+    uring* r = (uring*)mu_malloc(MEM_TAG_LOOP, sizeof(uring));
+    if (r == NULL)  {
+        return NULL;
+    }
+    memset(r, 0, sizeof(uring));
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;     //完成的事件在下次进入内核时处理，不用打断loop线程
+    p.cq_entries = URING_ENTRIES * 4;
+    r->ring_fd = sys_uring_setup(URING_ENTRIES, &p);
+    if (r->ring_fd < 0 && errno == EINVAL)  {
+        p.flags = IORING_SETUP_CQSIZE;
+        r->ring_fd = sys_uring_setup(URING_ENTRIES, &p);
+    }
+    if (r->ring_fd < 0)  {
+        uring_close(r);
+        return NULL;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP))  {
+        uring_close(r);
+        return NULL;
+    }
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)  {
+        if (r->cq_size > r->sq_size)  {
+            r->sq_size = r->cq_size;
+        }
+        r->cq_size = r->sq_size;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)  {
+        r->sq_ptr = NULL;
+        uring_close(r);
+        return NULL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)  {
+        r->cq_ptr = r->sq_ptr;
+    }
+    else  {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)  {
+            r->cq_ptr = NULL;
+            uring_close(r);
+            return NULL;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe*)mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)  {
+        r->sqes = NULL;
+        uring_close(r);
+        return NULL;
+    }
+
+    char* sq = (char*)r->sq_ptr;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_local_tail = *r->sq_tail;
+
+    char* cq = (char*)r->cq_ptr;
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    if (uring_setup_bufs(r) != 0)  {
+        uring_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+/* 内核不支持io_uring，或者不支持multishot recv用的provided buffer ring时返回0 */
+int uring_supported()
+{
+    uring* r = uring_open();
+    if (r == NULL)  {
+        return 0;
+    }
+    uring_close(r);
+    return 1;
+}
+
+int uring_create()
+{
+    uring* r = uring_open();
+    if (r == NULL)  {
+        debug_ret("create io_uring failed, file : %s, line : %d", __FILE__, __LINE__);
+        return -1;
+    }
+    int idx = __atomic_fetch_add(&ring_num, 1, __ATOMIC_RELAXED);
+    if (idx >= URING_MAX_RINGS)  {
+        debug_ret("too many io_uring, file : %s, line : %d", __FILE__, __LINE__);
+        uring_close(r);
+        return -1;
+    }
+    rings[idx] = r;
+    return idx;
+}
+
+void uring_free(int ring)
+{
+    if (ring < 0 || ring >= URING_MAX_RINGS || rings[ring] == NULL)  {
+        return;
+    }
+    uring_close(rings[ring]);
+    rings[ring] = NULL;
+}
+
+
+static int uring_submit(uring* r, unsigned wait_nr, unsigned flags, void* arg, size_t argsz)
+{
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    if (wait_nr > 0)  {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    int ret = sys_uring_enter(r->ring_fd, r->pending, wait_nr, flags, arg, argsz);
+    if (ret > 0)  {
+        r->pending -= (unsigned)ret > r->pending ? r->pending : (unsigned)ret;
+    }
+    return ret;
+}
+
+/* 提交队列满了先把已有的交给内核，本轮loop中的其他操作仍然攒到dispatch时一起提交 */
+static struct io_uring_sqe* uring_get_sqe(uring* r)
+{
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_local_tail - head >= r->sq_entries)  {
+        if (uring_submit(r, 0, 0, NULL, 0) < 0)  {
+            debug_sys("io_uring_enter failed, file : %s, line : %d", __FILE__, __LINE__);
+        }
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sq_local_tail - head >= r->sq_entries)  {
+            return NULL;
+        }
+    }
+
+    unsigned idx = r->sq_local_tail & r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->sq_local_tail++;
+    r->pending++;
+    return sqe;
+}
+
+static int uring_op_of(event* ev)
+{
+    if (ev->io_type == EVENT_IO_ACCEPT)  {
+        return URING_OP_ACCEPT;
+    }
+    else if (ev->io_type == EVENT_IO_RECV)  {
+        return URING_OP_RECV;
+    }
+    return URING_OP_POLL;
+}
+
+static unsigned uring_poll_mask(event* ev)
+{
+    return ev->event_flag & (POLLIN | POLLPRI | POLLOUT | POLLRDHUP);
+}
+
+/* 每个event只挂一个multishot操作，直到被取消或者内核结束它 */
+static void uring_arm(uring* r, event* ev)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(r);
+    if (sqe == NULL)  {
+        debug_msg("io_uring submission queue is full, fd : %d, file : %s, line : %d", ev->fd, __FILE__, __LINE__);
+        return;
+    }
+
+    int op = uring_op_of(ev);
+    sqe->fd = ev->fd;
+    sqe->user_data = (uint64_t)(uintptr_t)ev | op;
+    switch (op)  {
+    case URING_OP_ACCEPT:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        break;
+    case URING_OP_RECV:
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUF_GROUP;
+        break;
+    default:
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = uring_poll_mask(ev);
+        break;
+    }
+    ev->refs++;
+}
+
+void uring_add(int ring, event* ev)
+{
+    uring_arm(rings[ring], ev);
+}
+
+void uring_del(int ring, event* ev)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(rings[ring]);
+    if (sqe == NULL)  {
+        debug_msg("io_uring submission queue is full, fd : %d, file : %s, line : %d", ev->fd, __FILE__, __LINE__);
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;         //被取消的操作最后会带着-ECANCELED完成
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)ev | uring_op_of(ev);
+    sqe->user_data = 0;
+}
+
+void uring_modify(int ring, event* ev)
+{
+    if (uring_op_of(ev) != URING_OP_POLL)  {      //accept和recv不需要等可写
+        return;
+    }
+    struct io_uring_sqe* sqe = uring_get_sqe(rings[ring]);
+    if (sqe == NULL)  {
+        debug_msg("io_uring submission queue is full, fd : %d, file : %s, line : %d", ev->fd, __FILE__, __LINE__);
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_REMOVE;          //原地修改正在等待的poll，不用删掉重加
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)ev | URING_OP_POLL;
+    sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = uring_poll_mask(ev);
+    sqe->user_data = 0;
+}
+
+/* 只放进提交队列，到本轮loop结束时和其他操作一起交给内核，msg和它指向的数据在完成前不能改动 */
+void uring_sendmsg(int ring, event* ev, struct msghdr* msg)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(rings[ring]);
+    if (sqe == NULL)  {
+        debug_msg("io_uring submission queue is full, fd : %d, file : %s, line : %d", ev->fd, __FILE__, __LINE__);
+        return;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = ev->fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)ev | URING_OP_SEND;
+    ev->refs++;
+}
+
+
+/* 资源不够时accept结束了，马上重挂只会立刻再失败，变成提交、完成的空转；由定时器过一会再挂上，定时器持有event的一个引用 */
+static int uring_accept_exhausted(int res)
+{
+    return res == -EMFILE || res == -ENFILE || res == -ENOMEM || res == -ENOBUFS;
+}
+
+static void uring_accept_retry(void* arg)
+{
+    event* ev = (event*)arg;
+    ev->refs--;
+    if (ev->is_working && !ev->freed)  {
+        uring_arm(rings[ev->epoll_fd], ev);
+    }
+    else if (ev->freed && ev->refs == 0)  {
+        event_release(ev);
+    }
+}
+
+static void uring_complete(uring* r, struct io_uring_cqe* cqe)
+{
+    event* ev = (event*)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+    int op = cqe->user_data & URING_OP_MASK;
+    if (ev == NULL)  {          //取消和修改操作本身的结果
+        return;
+    }
+
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    int bid = -1;
+    if (cqe->flags & IORING_CQE_F_BUFFER)  {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    }
+    if (!more)  {
+        ev->refs--;
+    }
+
+    ev->refs++;               //回调中可能event_free，处理完之前不能真的释放
+    if ((ev->is_working || op == URING_OP_SEND) && !ev->freed)  {
+        ev->io_result = cqe->res;
+        ev->io_buf = bid >= 0 ? r->bufs + (size_t)bid * URING_BUF_SIZE : NULL;
+        switch (op)  {
+        case URING_OP_POLL:
+            if (cqe->res > 0)  {
+                ev->active_event = cqe->res;
+                event_handler(ev);
+            }
+            break;
+        case URING_OP_ACCEPT:
+            if (cqe->res >= 0 && ev->event_read_handler)  {
+                ev->event_read_handler(ev->fd, ev, ev->r_arg);
+            }
+            break;
+        case URING_OP_RECV:
+            if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED && ev->event_read_handler)  {    //缓冲区用完时内核结束multishot，下面重新挂上
+                ev->event_read_handler(ev->fd, ev, ev->r_arg);
+            }
+            break;
+        case URING_OP_SEND:
+            if (ev->event_write_handler)  {
+                ev->event_write_handler(ev->fd, ev, ev->w_arg);
+            }
+            break;
+        }
+    }
+    if (bid >= 0)  {
+        uring_buf_recycle(r, bid);
+    }
+
+    if (!more && op != URING_OP_SEND && cqe->res != -ECANCELED && ev->is_working && !ev->freed)  {
+        if (op == URING_OP_ACCEPT && uring_accept_exhausted(cqe->res))  {
+            debug_msg("accept failed: %s, retry in %d ms", strerror(-cqe->res), URING_ACCEPT_RETRY_MS);
+            ev->refs++;
+            event_loop_add_timer(ev->loop, URING_ACCEPT_RETRY_MS, TIMER_OPT_ONCE, uring_accept_retry, ev);
+        }
+        else  {
+            uring_arm(r, ev);
+        }
+    }
+
+    ev->refs--;
+    if (ev->freed && ev->refs == 0)  {
+        event_release(ev);
+    }
+}
+
+void uring_dispatch(event_loop* loop, int timeout)
+{
+    uring* r = rings[loop->epoll_fd];
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+    unsigned wait_nr = (head == tail && timeout != 0) ? 1 : 0;     //已经有完成的事件就不等
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    void* argp = NULL;
+    size_t argsz = 0;
+    unsigned flags = 0;
+    if (wait_nr > 0 && timeout > 0)  {
+        memset(&arg, 0, sizeof(arg));
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000LL;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        argp = &arg;
+        argsz = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    if (head == tail && timeout == 0)  {          //COOP_TASKRUN下完成事件要进一次内核才会投递，轮询时不等待也要进去收
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    if (r->pending > 0 || (flags & IORING_ENTER_GETEVENTS) || wait_nr > 0)  {          //本轮攒下的send、accept等一次提交，顺便等待完成事件
+        if (uring_submit(r, wait_nr, flags, argp, argsz) < 0)  {
+            if (errno != EINTR && errno != ETIME && errno != EBUSY)  {
+                debug_sys("io_uring_enter failed, file : %s, line : %d", __FILE__, __LINE__);
+            }
+        }
+    }
+
+    event_loop_update_time(loop);
+
+    tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    loop->active_num = (int)(tail - head);
+    while (head != tail)  {
+        struct io_uring_cqe cqe = r->cqes[head & r->cq_mask];
+        head++;
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);     //先腾出位置，回调中提交的操作可能马上完成
+        uring_complete(r, &cqe);
+    }
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+/* io_uring后端，接口和epoller_*一致，ring是uring_create返回的句柄 */
+
+typedef struct event_t event;
+typedef struct event_loop_t event_loop;
+
+int uring_supported();
+
+int uring_create();
+void uring_free(int ring);
+
+void uring_add(int ring, event* ev);
+void uring_del(int ring, event* ev);
+void uring_modify(int ring, event* ev);
+
+struct msghdr;
+void uring_sendmsg(int ring, event* ev, struct msghdr* msg);
+
+void uring_dispatch(event_loop* loop, int timeout);
@@ -12,9 +12,22 @@ int config_parse(char* file, config* conf)
 {
     conf->port = 2019;
     conf->work_thread = 0;
+    conf->cpu_affinity = NULL;
+    conf->reuse_port = 0;
+    conf->io_backend = 0;        // epoll
+    conf->allocator = 0;         // libc
+    conf->edge_triggered = 0;
+    conf->accept_budget = 64;
+    conf->dispatch_policy = 0;   // round robin
+    conf->max_events = 4096;
+    conf->busy_poll = 0;
+    conf->busy_poll_socket = 0;
+    conf->stats_interval = 0;
+    conf->rebalance_interval = 0;    // off, -R turns it on
 
     conf->timeout_keep_alive = 30;
     conf->connect_time_limit = 30;
+    conf->max_keep_alive_requests = 100;
 
     conf->rootdir = "./www";
     DIR *dirp = NULL;
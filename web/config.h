@@ -1,12 +1,25 @@
 #pragma once
 
 typedef struct {
-    int timeout_keep_alive;      // notify client connection timeout_keep_alive in header
-    int connect_time_limit;      // Connection: close when the connection is over time
+    int timeout_keep_alive;      // seconds a connection may stay idle before it is closed, advertised in Keep-Alive, 0 is no limit
+    int connect_time_limit;      // seconds a connection may live, the request in progress is answered with Connection: close, 0 is no limit
+    int max_keep_alive_requests; // requests served on one connection before Connection: close, advertised in Keep-Alive, 0 is no limit
     char *rootdir;               // html root directory 
     int rootdir_fd;              // fildes of rootdir 
     int port;
     int work_thread;
+    char *cpu_affinity;          // cpus the worker threads are pinned to, e.g. "0-7,16-23" or "all", NULL is not pinned
+    int reuse_port;              // every worker loop accepts on its own SO_REUSEPORT socket
+    int io_backend;              // IO_BACKEND_EPOLL or IO_BACKEND_URING, falls back to epoll if the kernel lacks io_uring
+    int allocator;               // MEM_ALLOC_LIBC, MEM_ALLOC_ARENA or MEM_ALLOC_HUGEPAGE, backs every mu_malloc
+    int edge_triggered;          // register connections with EPOLLET and drain them until EAGAIN
+    int accept_budget;           // max connections accepted per listener wakeup
+    int dispatch_policy;         // how accepted connections are spread over worker loops, see DispatchPolicy
+    int max_events;              // upper bound of the per-loop epoll_wait event array, it grows and shrinks with readiness
+    int busy_poll;               // us a worker keeps polling with timeout 0 after activity before it blocks, 0 is off
+    int busy_poll_socket;        // also set SO_BUSY_POLL to busy_poll on accepted sockets
+    int stats_interval;          // ms between per-loop stats lines in the log, 0 is off
+    int rebalance_interval;      // ms between checks that move idle keep-alive connections off a busy loop, 0 is off
 } config;
 
 int config_parse(char* file, config*);
\ No newline at end of file
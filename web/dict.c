@@ -7,6 +7,7 @@
 
 #include "dict.h"
 #include "str.h"
+#include "mevent/config.h"
 
 // https://www.byvoid.com/zhs/blog/string-hash-compare
 static unsigned int ssstr_hash_sdbm(const ssstr *key) 
@@ -26,7 +27,7 @@ void dict_put(dict_t *dict, const ssstr *key, void *val)
 {
   unsigned int hash = LOTOS_HASH(key);
   dict_node_t *p = dict->table[hash];
-  dict_node_t *q = (dict_node_t*)malloc(sizeof(dict_node_t));
+  dict_node_t *q = (dict_node_t*)mu_malloc(MEM_TAG_DICT, sizeof(dict_node_t));
 
   // p == NULL or p != NULL, the same
   dict_node_init(q, (ssstr *)key, val, p);
@@ -64,7 +65,7 @@ void dict_free(dict_t *d)
     dict_node_t *p = d->table[i];
     while (p != NULL) {
       dict_node_t *q = p->next;
-      free(p);
+      mu_free(p);
       d->used--;
       p = q;
     }
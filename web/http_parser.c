@@ -1,8 +1,10 @@
 
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "http_parser.h"
+#include "http_scan.h"
 
 #define AGAIN (1)
 #define OK    (0)
@@ -38,14 +40,14 @@ int parse_request_line(char* msg, int* len, parse_archive *ar)
 {
   assert(len);
   char *p;
-  for (p = ar->next_parse_pos; p < (msg + *len); p++) {
+  for (p = msg + ar->next_parse_pos; p < (msg + *len); p++) {
     char ch = *p;
     switch (ar->state) {
     case S_RL_BEGIN:
       switch (ch) {
       case 'a' ... 'z':
       case 'A' ... 'Z':
-        ar->method_begin = p;     //记录method开始的地方
+        ar->method_begin = p - msg;     //记录method开始的地方
         ar->state = S_RL_METHOD;
         break;
       default:
@@ -58,7 +60,7 @@ int parse_request_line(char* msg, int* len, parse_archive *ar)
       case 'A' ... 'Z':
         break;
       case ' ': {                //直到空格
-        ar->method = parse_method(ar->method_begin, p);
+        ar->method = parse_method(msg + ar->method_begin, p);
         if (ar->method == HTTP_INVALID)
           return INVALID_REQUEST;
         ar->state = S_RL_SP_BEFORE_URL;
@@ -78,7 +80,7 @@ int parse_request_line(char* msg, int* len, parse_archive *ar)
         return INVALID_REQUEST;
       default:
         ar->state = S_RL_URL;
-        ar->url_begin = p;
+        ar->url_begin = p - msg;
       }
       break;
 
@@ -88,14 +90,15 @@ int parse_request_line(char* msg, int* len, parse_archive *ar)
       case '\t':
         // assume url part has been received completely
         ar->state = S_RL_SP_BEFORE_VERSION;
-        int url_status = parse_url(ar->url_begin, p, ar);
+        int url_status = parse_url(msg + ar->url_begin, p, ar);
         if (url_status)
           return url_status;
         break;
       case '\r':
       case '\n':
         return INVALID_REQUEST;
-      default:
+      default: // skip the rest of the url at once
+        p = HTTP_SCAN_ANY(p + 1, msg + *len, " \t\r\n") - 1;
         break;
       } // end S_RL_URL
       break;
@@ -211,11 +214,11 @@ int parse_request_line(char* msg, int* len, parse_archive *ar)
       break;
     } // end switch(state)
   }   // end for
-  ar->next_parse_pos = msg + *len;
+  ar->next_parse_pos = *len;
   return AGAIN;
 done:;
-  ar->next_parse_pos = p + 1;
-  *len = p + 1 - msg;
+  ar->next_parse_pos = p + 1 - msg;
+  *len = ar->next_parse_pos;
   ar->state = S_HD_BEGIN;
   return OK;
 }
@@ -233,7 +236,7 @@ int parse_header_line(char* msg, int *len, parse_archive *ar)
 {
   char ch, *p;
   assert(len);
-  for (p = ar->next_parse_pos; p < (msg + *len); p++) {
+  for (p = msg + ar->next_parse_pos; p < (msg + *len); p++) {
     ch = *p;
     switch (ar->state) {
     case S_HD_BEGIN:
@@ -243,7 +246,7 @@ int parse_header_line(char* msg, int *len, parse_archive *ar)
       case '0' ... '9':
       case '-':
         ar->state = S_HD_NAME;
-        ar->header_line_begin = p;
+        ar->header_line_begin = p - msg;
         ar->isCRLF_LINE = false;
         break;
       case '\r':
@@ -264,10 +267,11 @@ int parse_header_line(char* msg, int *len, parse_archive *ar)
       case 'a' ... 'z':
       case '0' ... '9':
       case '-':
+        p = http_scan_token(p + 1, msg + *len) - 1;
         break;
       case ':':
         ar->state = S_HD_COLON;
-        ar->header_colon_pos = p;
+        ar->header_colon_pos = p - msg;
         break;
       default:
         return INVALID_REQUEST;
@@ -285,7 +289,7 @@ int parse_header_line(char* msg, int *len, parse_archive *ar)
         return INVALID_REQUEST;
       default:
         ar->state = S_HD_VAL;
-        ar->header_val_begin = p;
+        ar->header_val_begin = p - msg;
         break;
       }
       break;
@@ -300,7 +304,7 @@ int parse_header_line(char* msg, int *len, parse_archive *ar)
         return INVALID_REQUEST;
       default:
         ar->state = S_HD_VAL;
-        ar->header_val_begin = p;
+        ar->header_val_begin = p - msg;
         break;
       }
       break;
@@ -308,13 +312,14 @@ int parse_header_line(char* msg, int *len, parse_archive *ar)
     case S_HD_VAL:
       switch (ch) {
       case '\r':
-        ar->header_val_end = p;
+        ar->header_val_end = p - msg;
         ar->state = S_HD_CR_AFTER_VAL;
         break;
       case '\n':
         ar->state = S_HD_LF_AFTER_VAL;
         break;
-      default:
+      default: // skip the rest of the value at once
+        p = HTTP_SCAN_ANY(p + 1, msg + *len, "\r\n") - 1;
         break;
       }
       break;
@@ -330,17 +335,17 @@ int parse_header_line(char* msg, int *len, parse_archive *ar)
       break;
     } // end switch state
   }   // end for
-  ar->next_parse_pos = msg + *len;
+  ar->next_parse_pos = *len;
   return AGAIN;
 done:;
-  ar->next_parse_pos = p + 1;
-  *len = p + 1 - msg;
+  ar->next_parse_pos = p + 1 - msg;
+  *len = ar->next_parse_pos;
   ar->state = S_HD_BEGIN;
   ar->num_headers++;
 
   /* put header name and val into header[2] */
-  HEADER_SET(&ar->header[0], ar->header_line_begin, ar->header_colon_pos);
-  HEADER_SET(&ar->header[1], ar->header_val_begin, ar->header_val_end);
+  HEADER_SET(&ar->header[0], msg + ar->header_line_begin, msg + ar->header_colon_pos);
+  HEADER_SET(&ar->header[1], msg + ar->header_val_begin, msg + ar->header_val_end);
   return ar->isCRLF_LINE ? CRLF_LINE : OK;
 }
 
@@ -433,6 +438,7 @@ static int parse_url(char *begin, char *end, parse_archive *ar)
         curr_state = S_URL_QUERY;
         break;
       default:
+        p = HTTP_SCAN_ANY(p + 1, end + 1, " ?") - 1;
         break;
       }
       break;
@@ -442,7 +448,9 @@ static int parse_url(char *begin, char *end, parse_archive *ar)
       case ' ':
         Move_Str(ar->url.query_string, begin, p - begin);
         curr_state = S_URL_END;
+        break;
       default:
+        p = HTTP_SCAN_ANY(p + 1, end + 1, " ") - 1;
         break;
       }
       break;
@@ -471,14 +479,48 @@ int parse_header_body_identity(char* msg, int *len, parse_archive *ar)
 {
   if (ar->content_length <= 0)
     return OK;
-  // not that complicated, using `next_parse_pos` to indicate where to parse
-  size_t received = *len;
+  // body starts at offset `next_parse_pos`, anything beyond content_length belongs to the next pipelined request
+  size_t received = *len - ar->next_parse_pos;
+  size_t left = ar->content_length - ar->body_received;
+  if (received > left)
+    received = left;
   ar->body_received += received;
 
-  ar->next_parse_pos = msg + *len;
+  ar->next_parse_pos += received;
 
   if (ar->body_received >= ar->content_length)  { // full data recv
     return OK;
   }
   return AGAIN; // will conitinue to recv until full data recv or conn timeout
 }
+
+static void rebase_str(ssstr *s, uintptr_t from, uintptr_t parsed, char *to)
+{
+  if (s->str && (uintptr_t)s->str - from <= parsed)
+    s->str = to + ((uintptr_t)s->str - from);
+}
+
+/* the request bytes were copied to `base` (the read buffer was taken over or grown
+   between two reads): move every parsed result that pointed into the old copy */
+void parse_archive_rebase(parse_archive *ar, char *base)
+{
+  if (ar->base == base)
+    return;
+  if (ar->base && ar->next_parse_pos > 0) {
+    uintptr_t from = (uintptr_t)ar->base;
+    rebase_str(&ar->request_url_string, from, ar->next_parse_pos, base);
+    rebase_str(&ar->url.abs_path, from, ar->next_parse_pos, base);
+    rebase_str(&ar->url.query_string, from, ar->next_parse_pos, base);
+    rebase_str(&ar->url.mime_extension, from, ar->next_parse_pos, base);
+    rebase_str(&ar->header[0], from, ar->next_parse_pos, base);
+    rebase_str(&ar->header[1], from, ar->next_parse_pos, base);
+
+    ssstr *slot = (ssstr *)&ar->req_headers;
+    int i;
+    for (i = 0; i < sizeof(request_headers_t) / sizeof(ssstr); i++) {
+      if (ar->req_headers_mask & (1u << i))
+        rebase_str(&slot[i], from, ar->next_parse_pos, base);
+    }
+  }
+  ar->base = base;
+}
@@ -3,6 +3,7 @@
 
 #include "str.h"
 #include <string.h>
+#include <stddef.h>
 #include <ctype.h>
 
 /* RFC2616 */
@@ -143,48 +144,79 @@ typedef struct {
   ssstr content_length;
 } request_headers_t;
 
+/**
+ * Fields up to `req_headers` are touched by every request and are reset by
+ * `parse_archive_init`; keep them together so they stay in a few cache lines.
+ * `req_headers` is cold storage: a slot is only valid when its bit is set in
+ * `req_headers_mask`, so it never needs to be cleared between requests.
+ */
 typedef struct {
+  /* preserve buffer_t state, so when recv new data, we can keep parsing.
+   * positions are offsets from the first byte of the request, so they stay
+   * valid when the bytes are moved to another buffer between two reads */
+  char *base;           /* where the request started at the last parse */
+  int next_parse_pos;   /* parser position in buffer_t */
+  int state;            /* parser state */
+
   /* parsed request line result */
   http_method method;
   http_version version;
-  ssstr request_url_string;
-  req_url url;
-  
+
   /* parsed header lines result */
   bool keep_alive;       /* connection keep alive */
+  bool isCRLF_LINE;
+  bool response_done;
+  bool err_req;
   int content_length;    /* request body content_length */
   int transfer_encoding; /* affect body recv strategy */
-  request_headers_t req_headers;
-
   int num_headers;
-  ssstr header[2]; /* store header every time `parse_header_line` */
-
-  /* preserve buffer_t state, so when recv new data, we can keep parsing */
-  char *next_parse_pos; /* parser position in buffer_t */
-  int state;            /* parser state */
+  unsigned int req_headers_mask; /* which slots of req_headers are set */
 
   /* private members, do not modify !!! */
-  char *method_begin;
-  char *url_begin;
-  char *header_line_begin;
-  char *header_colon_pos;
-  char *header_val_begin;
-  char *header_val_end;
+  int method_begin;
+  int url_begin;
+  int header_line_begin;
+  int header_colon_pos;
+  int header_val_begin;
+  int header_val_end;
   size_t body_received;
-  bool isCRLF_LINE;
-  bool response_done;
-  bool err_req;
+
+  ssstr header[2]; /* store header every time `parse_header_line` */
+  ssstr request_url_string;
+  req_url url;
+
+  /* cold: only written for headers the request actually carries */
+  request_headers_t req_headers;
 } parse_archive;
 
 static inline void parse_archive_init(parse_archive *ar) 
 {
-  memset(ar, 0, sizeof(parse_archive));
+  memset(ar, 0, offsetof(parse_archive, req_headers));
   ar->isCRLF_LINE = true;
   ar->content_length = -1; // no Content-Length header
 }
 
+/* `offset` is offsetof(request_headers_t, xxx) */
+static inline ssstr *parse_archive_set_header(parse_archive *ar, size_t offset)
+{
+  ar->req_headers_mask |= 1u << (offset / sizeof(ssstr));
+  return (ssstr *)((char *)&ar->req_headers + offset);
+}
+
+static inline ssstr parse_archive_get_header(const parse_archive *ar, size_t offset)
+{
+  if (ar->req_headers_mask & (1u << (offset / sizeof(ssstr)))) {
+    return *(const ssstr *)((const char *)&ar->req_headers + offset);
+  }
+  return (ssstr){NULL, 0};
+}
+
+#define PARSE_HEADER(ar, name) \
+  parse_archive_get_header((ar), offsetof(request_headers_t, name))
+
 extern int parse_request_line(char *msg, int* len, parse_archive *ar);
 extern int parse_header_line(char* msg, int* len, parse_archive *ar);
 extern int parse_header_body_identity(char* msg, int* len, parse_archive *ar);
+extern void parse_archive_rebase(parse_archive *ar, char *base);
 
 
@@ -5,7 +5,7 @@
 #include <fcntl.h>
 #include <stddef.h>
 #include <stdio.h>
-#include <sys/sendfile.h>
+#include <limits.h>
 
 #include "mevent/connection.h"
 #include "mevent/ring_buffer.h"
@@ -24,6 +24,9 @@
 #define AGAIN (1)
 #define ERROR (-1)
 
+#define PIPELINE_COALESCE_FILE (64 * 1024)  /* larger files of pipelined requests are still sent with sendfile */
+#define MAX_HEADER_SIZE (16 * 1024)         /* request line plus headers, a client still sending more is answered 414/431 and closed */
+
 
 extern config server_config;
 
@@ -98,41 +101,72 @@ void header_handler_dict_free() { dict_free(&header_handler_dict); }
 
 
 
+/* parse and answer every complete request in the read buffer, in order; a partial one stays for the next read
+   and parsing resumes where it stopped. responses of pipelined requests are queued and go out together in one write */
 int http_request(request* req)
 {
     if (!req)  {
         return -1;
     }
-    http_request_handle_reset(req);        //reset connect if has
+    connection* conn = req->conn;
+    ring_buffer* rb = conn->ring_buffer_read;
 
-    int status = OK;
-    int len = ring_buffer_readable_bytes(req->conn->ring_buffer_read);
-    do  {
-        status = req->req_handler(req);
-    }  while(req->req_handler != NULL && status == OK);
+    while (ring_buffer_readable_bytes(rb) > 0
+           && !connection_file_pending(conn))  {      //the next requests wait until the file is out, the connection calls us again then
+        int len = 0;
+        char* msg = ring_buffer_get_msg(rb, &len);
+        parse_archive_rebase(&req->par, msg);  //the partial request may have been copied to another buffer since the last read
 
-    ring_buffer_release_bytes(req->conn->ring_buffer_read, len);
+        int status = OK;
+        do  {
+            status = req->req_handler(req);
+        }  while(req->req_handler != NULL && status == OK);
 
-    if (status == OK)  {
-        response_handle(req);
-    }
-    else  {
-        response_assemble_err_buffer(req, status);
-    }
+        if (status == AGAIN)  {                //not complete yet, keep the bytes and the parser state, go on with the next read
+            break;
+        }
 
-    if (!req->par.keep_alive)  {           //short connection should active close connection after a request
-        connection_active_close(req->conn);
-    }
+        int used = status == OK ? req->par.next_parse_pos : len;
+        req->pipelined = used < len;
+
+        req->request_count++;
+        if (conn->expired || (server_config.max_keep_alive_requests > 0
+            && req->request_count >= server_config.max_keep_alive_requests))  {      //last request on this connection
+            req->par.keep_alive = false;
+        }
+
+        int ret;
+        if (status == OK)  {
+            ret = response_handle(req);
+        }
+        else  {
+            ret = response_assemble_err_buffer(req, status);
+        }
+
+        http_request_handle_unint(req);        //should not free req here when persistent connection
+        ring_buffer_release_bytes(rb, used);   //parse results point into these bytes, release after the response
 
-    http_request_handle_unint(req);        //should not free req here when persistent connection
+        if (ret != OK)  {                      //the response could not be queued or sent whole, what is queued must not go out
+            connection_abort(conn);
+            return 0;
+        }
+        if (!req->par.keep_alive)  {           //short connection should active close connection after a request, req is freed with it
+            connection_active_close(conn);
+            return 0;
+        }
+        http_request_handle_reset(req);        //ready for the next request
+    }
 
+    if (buffer_chain_bytes(&conn->write_chain) > 0 && connection_send_buffer(conn) < 0)  {
+        connection_abort(conn);
+    }
     return 0;
 }
 
 
 void http_request_handle_init(connection* conn)
 {
-    request* req = (request*)mu_malloc(sizeof(request));
+    request* req = (request*)connection_context(conn);      //lives in the connection block, released with it
     memset(req, 0, sizeof(request));
     conn->handler = req;
     req->conn = conn;
@@ -145,10 +179,18 @@ void http_request_handle_unint(request* req)
 {
     if (req->resource_fd > 0)  {
         close(req->resource_fd);
+        req->resource_fd = -1;
     }
 }
 
 
+/* the connection is going away, maybe in the middle of a request */
+void http_request_handle_close(connection* conn)
+{
+    http_request_handle_unint((request*)conn->handler);
+}
+
+
 void http_request_handle_reset(request* req)
 {
     parse_archive_init(&req->par);
@@ -165,14 +207,11 @@ static int request_handle_request_line(request *r)     //parse request line
 {       
     int msg_len = 0;
     char* msg = ring_buffer_get_msg(r->conn->ring_buffer_read, &msg_len);
-    if (!r->par.next_parse_pos)  {
-        r->par.next_parse_pos = msg;
-    }
-    
+
     int status = parse_request_line(msg, &msg_len, &r->par);
     if (status != OK)  {
         if (status == AGAIN)  {
-            return AGAIN;
+            return r->par.next_parse_pos >= MAX_HEADER_SIZE ? 414 : AGAIN;
         }
         else   {
             return 400;
@@ -187,16 +226,18 @@ static int request_handle_request_line(request *r)     //parse request line
     }
     archive->keep_alive = (archive->version.http_major == 1 && archive->version.http_minor == 1);
 
-    // make `relative_path` a c-style string, really ugly....
-    char *p = archive->url.abs_path.str;
-    while (*p && *p != ' ' && *p != '?') {
-        p++;
+    // copy `relative_path` out as a c-style string, the read buffer may still hold the next pipelined request
+    char path[PATH_MAX];
+    int path_len = archive->url.abs_path.len;
+    if (path_len >= sizeof(path)) {
+        return 414;
     }
-    *p = '\0';
+    memcpy(path, archive->url.abs_path.str, path_len);
+    path[path_len] = '\0';
 
     /* check abs_path */
     const char *relative_path = NULL;
-    relative_path = archive->url.abs_path.len == 1 && archive->url.abs_path.str[0] == '/' ? "./" : archive->url.abs_path.str + 1;
+    relative_path = path_len == 1 && path[0] == '/' ? "./" : path + 1;
 
     int fd = openat(server_config.rootdir_fd, relative_path, O_RDONLY);
     if (fd == ERROR)  {
@@ -229,25 +270,20 @@ static int request_handle_headers(request *r)     //parse request header
     parse_archive *archive = &r->par;
 
     int msg_len = 0;
-    int msg_left = 0;
     char* msg = ring_buffer_get_msg(r->conn->ring_buffer_read, &msg_len);
-    msg_left = msg_len;
-        
+
     while (true) {
-        status = parse_header_line(msg, &msg_len, archive);      //msg_len is in and out 
+        int len = msg_len;        //in: bytes of the request so far, out: end of the parsed line, both counted from msg
+        status = parse_header_line(msg, &len, archive);
         switch (status)  {
-        case AGAIN:                 // not a complete header 
-            debug_msg("parse request header line error: not completed\n");
-            return AGAIN;
+        case AGAIN:                 // not a complete header, resume from here on the next read
+            return archive->next_parse_pos >= MAX_HEADER_SIZE ? 431 : AGAIN;
         case INVALID_REQUEST:       // header invalid
             debug_msg("parse request header line error: invalide request\n");
             return 400;
         case CRLF_LINE:             // all headers completed 
             goto header_done;
         case OK:                    // a header completed 
-            msg += msg_len;
-            msg_left -= msg_len;
-            msg_len = msg_left;
             ssstr_tolower(&r->par.header[0]);
 
             // handle header individually
@@ -300,8 +336,7 @@ int request_handle_hd_base(request *r, void* hf)
  {
     parse_archive *archive = &r->par;
     header_func* hf_ = (header_func*)hf;
-    size_t offset = hf_->offset;
-    ssstr *item = (ssstr *)(((char *)(&archive->req_headers)) + offset);
+    ssstr *item = parse_archive_set_header(archive, hf_->offset);
     *item = archive->header[1];
     return OK;
 }
@@ -309,10 +344,10 @@ int request_handle_hd_base(request *r, void* hf)
 int request_handle_hd_connection(request *r, void* hf) 
 {
     request_handle_hd_base(r, hf);
-    ssstr *connection = &(r->par.req_headers.connection);
-    if (ssstr_caseequal(connection, "keep-alive")) {
+    ssstr connection = PARSE_HEADER(&r->par, connection);
+    if (ssstr_caseequal(&connection, "keep-alive")) {
         r->par.keep_alive = true;
-    }  else if (ssstr_caseequal(connection, "close")) {
+    }  else if (ssstr_caseequal(&connection, "close")) {
         r->par.keep_alive = false;
     }  else {
         return 400;
@@ -323,8 +358,8 @@ int request_handle_hd_connection(request *r, void* hf)
 int request_handle_hd_content_length(request *r, void* hf) 
 {
     request_handle_hd_base(r, hf);
-    ssstr *content_length = &(r->par.req_headers.content_length);
-    int len = atoi(content_length->str);
+    ssstr content_length = PARSE_HEADER(&r->par, content_length);
+    int len = atoi(content_length.str);
     if (len <= 0) {
         return 400;
     }
@@ -337,12 +372,12 @@ int request_handle_hd_content_length(request *r, void* hf)
 int request_handle_hd_transfer_encoding(request *r, void* hf) 
 {
     request_handle_hd_base(r, hf);
-    ssstr *transfer_encoding = &(r->par.req_headers.transfer_encoding);
-    if (ssstr_caseequal(transfer_encoding, "chunked")  ||
-        ssstr_caseequal(transfer_encoding, "compress") ||
-        ssstr_caseequal(transfer_encoding, "deflate")  ||
-        ssstr_caseequal(transfer_encoding, "gzip")     ||
-        ssstr_caseequal(transfer_encoding, "identity"))  {
+    ssstr transfer_encoding = PARSE_HEADER(&r->par, transfer_encoding);
+    if (ssstr_caseequal(&transfer_encoding, "chunked")  ||
+        ssstr_caseequal(&transfer_encoding, "compress") ||
+        ssstr_caseequal(&transfer_encoding, "deflate")  ||
+        ssstr_caseequal(&transfer_encoding, "gzip")     ||
+        ssstr_caseequal(&transfer_encoding, "identity"))  {
             return 501;   //Not Implemented
         }
     else  {
@@ -360,23 +395,27 @@ int response_handle( request* r)
         status = r->res_handler(r);
     }  while(status == OK && !r->par.response_done);
 
-    //todo close connection ?
-    return status;
+    return status;       //not OK: the caller closes the connection
 }
 
 int response_handle_send_line_and_header(request *r) 
 {
-    response_append_status_line(r);
-    response_append_date(r);
-    response_append_server(r);
-    response_append_content_type(r);
-    response_append_content_length(r);
-    response_append_connection(r);
-    response_append_timeout(r);
-    response_append_crlf(r);
-
-    int ret = connection_send_buffer(r->conn);
-    if (ret == 0)  {
+    if (response_append_status_line(r) < 0
+        || response_append_date(r) < 0
+        || response_append_server(r) < 0
+        || response_append_content_type(r) < 0
+        || response_append_content_length(r) < 0
+        || response_append_connection(r) < 0
+        || response_append_timeout(r) < 0
+        || response_append_crlf(r) < 0)  {
+        return 500;
+    }
+
+    int ret = 0;
+    if (!r->pipelined)  {                   //pipelined responses are flushed together by http_request
+        ret = connection_send_buffer(r->conn);
+    }
+    if (ret == 0 || ret == 1)  {            //on partial send the file is queued behind the rest of the header
         if (r->resource_fd != -1) {
             r->res_handler = response_handle_send_file;
         }
@@ -385,24 +424,27 @@ int response_handle_send_line_and_header(request *r)
         }
         return OK;
     }
-    else if (ret == 1) {
-        if (r->resource_fd != -1) {
-            //todo   read file and send file in buff
-        } 
-        r->par.response_done = true;
-        return OK;
-    }
     return 500;
 }
 
 int response_handle_send_file( request *r) 
 {
-    int len = sendfile(r->conn->connfd, r->resource_fd, NULL, r->resource_size);
-    if (len == 0 || r->resource_size == len)  {
+    if (r->pipelined && r->resource_size <= PIPELINE_COALESCE_FILE)  {      //small file goes into the same write as the other responses
+        int len = connection_append_file(r->conn, r->resource_fd, r->resource_size);
+        if (len != r->resource_size) {
+            return 500;
+        }
         r->par.response_done = true;
         return OK;
     }
-    return 500;
+
+    int ret = connection_send_file(r->conn, r->resource_fd, r->resource_size);      //streamed after the queued responses
+    r->resource_fd = -1;                    //owned by the connection now, closed when the file is out
+    if (ret != 0) {
+        return 500;
+    }
+    r->par.response_done = true;
+    return OK;
 }
 
 
@@ -419,21 +461,31 @@ int response_assemble_err_buffer(request *r, int status_code)
         fstat(resource_fd, &st);
         resource_size = st.st_size;
     }
+    r->resource_size = resource_size;     // Content-Length must describe error.html, not the failed request's resource
 
-    response_append_status_line(r);
-    response_append_date(r);
-    response_append_server(r);
-    response_append_content_type(r);
-    response_append_content_length(r);
     r->par.keep_alive = false;
-    response_append_connection(r);
-    response_append_crlf(r);
+    if (response_append_status_line(r) < 0
+        || response_append_date(r) < 0
+        || response_append_server(r) < 0
+        || response_append_content_type(r) < 0
+        || response_append_content_length(r) < 0
+        || response_append_connection(r) < 0
+        || response_append_crlf(r) < 0
+        || connection_send_buffer(r->conn) < 0)  {        //状态行和头部要在文件内容之前发出
+        if (resource_fd > 0)  {
+            close(resource_fd);
+        }
+        return ERROR;
+    }
 
+    int ret = 0;
     if (resource_fd > 0 && resource_size > 0)  {
-        sendfile(r->conn->connfd, resource_fd, NULL, resource_size);
+        ret = connection_send_file(r->conn, resource_fd, resource_size);      //the connection closes it
+    }
+    else if (resource_fd > 0)  {
         close(resource_fd);
     }
 
     r->par.response_done = true;
-    return OK;
+    return ret == 0 ? OK : ERROR;
 }
\ No newline at end of file
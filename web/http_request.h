@@ -7,12 +7,14 @@ typedef struct request_t request;
 
 struct request_t {
     connection *conn;                     /* belonged connection */
-    parse_archive par;                    /* parse_archive */
+    int (*req_handler)(request *);        /* request handler for rl, hd, bd */
+    int (*res_handler)(request *);        /* response handler for hd bd */
     int resource_fd;                      /* resource fildes */
     int resource_size;                    /* resource size */
     int status_code;                      /* response status code */
-    int (*req_handler)(request *);        /* request handler for rl, hd, bd */
-    int (*res_handler)(request *);        /* response handler for hd bd */
+    int request_count;                    /* requests served on this connection */
+    int pipelined;                        /* more requests follow in the read buffer, flush the response with theirs */
+    parse_archive par;                    /* parse_archive, hot fields first, header slots last */
 } ;
 
 int http_request(request*);  
@@ -21,6 +23,8 @@ void header_handler_dict_init();
 
 void http_request_handle_init(connection* conn);
 
+void http_request_handle_close(connection* conn);
+
 int request_reset(request *r);
 
 int response_handle(request *r);
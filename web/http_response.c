@@ -1,6 +1,5 @@
 #include <time.h>
 #include <stdio.h>
-#include "mevent/ring_buffer.h"
 #include "mevent/connection.h"
 #include "http_response.h"
 #include "http_request.h"
@@ -54,52 +53,33 @@ void status_table_init() {
 #undef XX
 }
 
-void response_append_status_line(request *r) 
+int response_append_status_line(request *r) 
 {
-    ring_buffer* buf = r->conn->ring_buffer_write;
-
-    char temp[64] = {0};
-    if (r->par.version.http_major == 1)  {
-        strcpy(temp, "HTTP/1.1 ");
-    }
-    else  {
-        strcpy(temp, "HTTP/1.0 ");
-    }
+    buffer_chain* buf = &r->conn->write_chain;
     const char* str_status = Status_Table[r->status_code];
-    if (str_status != NULL)  {
-        strcat(temp, str_status);
-    }
-    strcat(temp, CRLF);
-
-    ring_buffer_push_data(buf, temp, strlen(temp));
+    return buffer_chain_printf(buf, "HTTP/1.%d %s" CRLF, r->par.version.http_major == 1 ? 1 : 0, str_status ? str_status : "");
 }
 
 
 
-void response_append_date(request *r)
+int response_append_date(request *r)
  {
-    ring_buffer* buf = r->conn->ring_buffer_write;
-    char temp[64] = {0};
-
-    time_t now = time(NULL);
-    struct tm *tm = localtime(&now);
-    strftime(temp, sizeof(temp), "Date: %a, %d %b %Y %H:%M:%S GMT" CRLF, tm);
-    ring_buffer_push_data(buf, temp, strlen(temp));
+    buffer_chain* buf = &r->conn->write_chain;
+    return buffer_chain_printf(buf, "Date: %s" CRLF, event_loop_http_date(r->conn->loop));      //formatted by the loop once per second
 }
 
 
-void response_append_server(request *r) 
+int response_append_server(request *r) 
 {
-    ring_buffer* buf = r->conn->ring_buffer_write;
-    char temp[64] = "Server: ";
-    strcat(temp, SERVER_NAME CRLF);
-    ring_buffer_push_data(buf, temp, strlen(temp));
+    buffer_chain* buf = &r->conn->write_chain;
+    ssstr server = SSSTR("Server: " SERVER_NAME CRLF);
+    return buffer_chain_append(buf, server.str, server.len);
 }
 
 
-void response_append_content_type(request *r) 
+int response_append_content_type(request *r) 
 {
-    ring_buffer* buf = r->conn->ring_buffer_write;
+    buffer_chain* buf = &r->conn->write_chain;
     ssstr content_type;
     do  {
         if (r->par.err_req)  {
@@ -113,29 +93,25 @@ void response_append_content_type(request *r)
             content_type = SSSTR("text/html");
         }
     }  while(0);
-    char temp[128] = "Content-Type: ";
-    strcat(temp, content_type.str);
-    strcat(temp, CRLF);
-    ring_buffer_push_data(buf, temp, strlen(temp));
+    return buffer_chain_printf(buf, "Content-Type: %.*s" CRLF, content_type.len, content_type.str);
 }
 
 
-void response_append_content_length(request *r) 
+int response_append_content_length(request *r) 
 {
-    ring_buffer* buf = r->conn->ring_buffer_write;
+    buffer_chain* buf = &r->conn->write_chain;
     int len = r->resource_size;
     
     if (len >= 0)  {
-        char temp[64] = {0};
-        sprintf(temp, "Content-Length: %d" CRLF, len);
-        ring_buffer_push_data(buf, temp, strlen(temp));
+        return buffer_chain_printf(buf, "Content-Length: %d" CRLF, len);
     }
+    return 0;
 }
 
 
-void response_append_connection(request *r) 
+int response_append_connection(request *r) 
 {
-    ring_buffer* buf = r->conn->ring_buffer_write;
+    buffer_chain* buf = &r->conn->write_chain;
     ssstr connection;
     if (r->par.keep_alive)  {
         connection = SSSTR("Connection: keep-alive" CRLF);
@@ -143,27 +119,29 @@ void response_append_connection(request *r)
     else  {
         connection = SSSTR("Connection: close" CRLF);
     }
-    if ((time(NULL) - r->conn->time_on_connect) > server_config.connect_time_limit)   {    //if the connection take up a lot of time, tell the client close
-        connection = SSSTR("Connection: close" CRLF);
-    }
-    ring_buffer_push_data(buf, connection.str, connection.len);
+    return buffer_chain_append(buf, connection.str, connection.len);
 }
 
 
 int Keep_Alive = 30;
-void response_append_timeout(request *r) 
+int response_append_timeout(request *r) 
 {
-    ring_buffer* buf = r->conn->ring_buffer_write;
+    buffer_chain* buf = &r->conn->write_chain;
     if (r->par.keep_alive)  {
-        char temp[64] = {0};
-        sprintf(temp, "Keep-Alive: timeout=%d, max=1" CRLF, server_config.timeout_keep_alive);    //it may not work, depends on client's behaviour
-        ring_buffer_push_data(buf, temp, strlen(temp));
+        int max = server_config.max_keep_alive_requests;
+        if (max > 0)  {         //requests left on this connection, the limits are enforced by the connection timers
+            return buffer_chain_printf(buf, "Keep-Alive: timeout=%d, max=%d" CRLF, server_config.timeout_keep_alive, max - r->request_count);
+        }
+        else  {
+            return buffer_chain_printf(buf, "Keep-Alive: timeout=%d" CRLF, server_config.timeout_keep_alive);
+        }
     }
+    return 0;
 }
 
 
-void response_append_crlf(request *r) 
+int response_append_crlf(request *r) 
 {
-    ring_buffer* buf = r->conn->ring_buffer_write;
-    ring_buffer_push_data(buf, CRLF, strlen(CRLF));
-}
\ No newline at end of file
+    buffer_chain* buf = &r->conn->write_chain;
+    return buffer_chain_append(buf, CRLF, 2);
+}
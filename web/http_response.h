@@ -80,13 +80,14 @@ void mime_dict_free();
 void status_table_init();
 
 
-void response_append_status_line(request *r);
-void response_append_date(request *r);
-void response_append_server( request *r);
-void response_append_content_type( request *r);
-void response_append_content_length( request *r);
-void response_append_connection( request *r);
-void response_append_timeout( request *r);
-void response_append_crlf( request *r);
+/* each appends one part of the header to the connection's write buffer, -1 when the buffer cannot grow */
+int response_append_status_line(request *r);
+int response_append_date(request *r);
+int response_append_server( request *r);
+int response_append_content_type( request *r);
+int response_append_content_length( request *r);
+int response_append_connection( request *r);
+int response_append_timeout( request *r);
+int response_append_crlf( request *r);
 
 
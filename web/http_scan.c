@@ -0,0 +1,133 @@
+
+#include <string.h>
+
+#include "http_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_SCAN_X86
+#endif
+
+static inline int is_token(char ch)
+{
+  return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+         (ch >= '0' && ch <= '9') || ch == '-';
+}
+
+static char *scan_any_scalar(char *p, char *end, const char *set, int n)
+{
+  int i;
+  for (; p < end; p++) {
+    for (i = 0; i < n; i++) {
+      if (*p == set[i])
+        return p;
+    }
+  }
+  return end;
+}
+
+static char *scan_token_scalar(char *p, char *end)
+{
+  for (; p < end; p++) {
+    if (!is_token(*p))
+      return p;
+  }
+  return end;
+}
+
+#ifdef HTTP_SCAN_X86
+
+/* pcmpestri compares 16 bytes against up to 16 wanted bytes or 8 ranges in one instruction;
+   only whole 16-byte blocks are loaded, the tail is done byte by byte so we never read past end */
+__attribute__((target("sse4.2")))
+static char *scan_any_sse42(char *p, char *end, const char *set, int n)
+{
+  char wanted[16] = {0};
+  memcpy(wanted, set, n);
+  __m128i s = _mm_loadu_si128((const __m128i *)wanted);
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    int i = _mm_cmpestri(s, n, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+    if (i != 16)
+      return p + i;
+  }
+  return scan_any_scalar(p, end, set, n);
+}
+
+__attribute__((target("sse4.2")))
+static char *scan_token_sse42(char *p, char *end)
+{
+  static const char ranges[16] = "AZaz09--";
+  __m128i r = _mm_loadu_si128((const __m128i *)ranges);
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    int i = _mm_cmpestri(r, 8, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+                                      _SIDD_NEGATIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT);
+    if (i != 16)
+      return p + i;
+  }
+  return scan_token_scalar(p, end);
+}
+
+/* compare 32 bytes against each wanted byte, the first hit is the lowest bit of the mask */
+__attribute__((target("avx2")))
+static char *scan_any_avx2(char *p, char *end, const char *set, int n)
+{
+  int i;
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hit = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(set[0]));
+    for (i = 1; i < n; i++)
+      hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(set[i])));
+    unsigned int mask = _mm256_movemask_epi8(hit);
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+  return scan_any_scalar(p, end, set, n);
+}
+
+/* bytes >= 0x80 are negative as signed chars and fall outside every range */
+__attribute__((target("avx2")))
+static char *scan_token_avx2(char *p, char *end)
+{
+  const __m256i a = _mm256_set1_epi8('a' - 1), z = _mm256_set1_epi8('z' + 1);
+  const __m256i d0 = _mm256_set1_epi8('0' - 1), d9 = _mm256_set1_epi8('9' + 1);
+  const __m256i dash = _mm256_set1_epi8('-'), lower = _mm256_set1_epi8(0x20);
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i l = _mm256_or_si256(v, lower); /* 'A'-'Z' -> 'a'-'z' */
+    __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(l, a), _mm256_cmpgt_epi8(z, l));
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, d0), _mm256_cmpgt_epi8(d9, v));
+    __m256i ok = _mm256_or_si256(_mm256_or_si256(alpha, digit), _mm256_cmpeq_epi8(v, dash));
+    unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(ok);
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+  return scan_token_scalar(p, end);
+}
+
+#endif
+
+char *(*http_scan_any)(char *p, char *end, const char *set, int n) = scan_any_scalar;
+char *(*http_scan_token)(char *p, char *end) = scan_token_scalar;
+
+/* choose the widest implementation the cpu supports, returns its name */
+const char *http_scan_init()
+{
+#ifdef HTTP_SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    http_scan_any = scan_any_avx2;
+    http_scan_token = scan_token_avx2;
+    return "avx2";
+  }
+  if (__builtin_cpu_supports("sse4.2")) {
+    http_scan_any = scan_any_sse42;
+    http_scan_token = scan_token_sse42;
+    return "sse4.2";
+  }
+#endif
+  http_scan_any = scan_any_scalar;
+  http_scan_token = scan_token_scalar;
+  return "scalar";
+}
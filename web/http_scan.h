@@ -0,0 +1,17 @@
+#pragma once
+
+/**
+ * Vectorized delimiter search for the request parser.
+ * `http_scan_init` picks AVX2, SSE4.2 or plain C once at startup,
+ * before that the plain C versions are used.
+ */
+
+/* first byte in [p, end) equal to any of the n (<= 16) bytes in set, end if none */
+extern char *(*http_scan_any)(char *p, char *end, const char *set, int n);
+
+/* first byte in [p, end) that is not a header name character [A-Za-z0-9-], end if none */
+extern char *(*http_scan_token)(char *p, char *end);
+
+#define HTTP_SCAN_ANY(p, end, set) http_scan_any((p), (end), (set), sizeof(set) - 1)
+
+extern const char *http_scan_init();
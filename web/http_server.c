@@ -2,11 +2,16 @@
 #include "mevent/servermanager.h"
 #include "mevent/listener.h"
 #include "mevent/connection.h"
+#include "mevent/event.h"
+#include "mevent/epoll.h"
+#include "mevent/event_loop.h"
 #include "mevent/ring_buffer.h"
 #include "mevent/config.h"
 #include "web/config.h"
 #include "web/http_request.h"
 #include "web/http_response.h"
+#include "web/http_scan.h"
+#include "misc/logger.h"
 
 #include <stdio.h>
 #include <sys/time.h>
@@ -24,19 +29,14 @@ static void onMessage(connection *conn)           //in worker thread if has, and
     http_request(conn->handler);  
 }
 
-static void onDisconnected(connection* conn)
-{
-    //debug_msg("onDisconnected : %d\n", conn->connfd);
-    request* req = (request*)conn->handler;
-    free(req);
-}
-
-static void onConnection(connection* conn)       //in main thread
+static void onConnection(connection* conn)       //in the loop thread owning conn
 {
     //debug_msg("connected!!!! fd is %d\n", conn->connfd);
     http_request_handle_init(conn);
+    connection_set_disconnect_callback(conn, http_request_handle_close);     //a request cut off half way still holds its file
 
-    connection_set_disconnect_callback(conn, onDisconnected);
+    connection_set_idle_timeout(conn, server_config.timeout_keep_alive * 1000);
+    connection_set_lifetime(conn, server_config.connect_time_limit * 1000);
 }
 
 void http_server_init()
@@ -44,6 +44,7 @@ void http_server_init()
     mime_dict_init();
     header_handler_dict_init();
     status_table_init();
+    debug_msg("http parser scans with %s", http_scan_init());
 
     config_parse("", &server_config);
 }
@@ -55,7 +56,19 @@ void http_server_start(char* p_host, int* p_port, int* p_work_thread)
     int port = (p_port ? *p_port : server_config.port);
     int work_thread = (p_work_thread ? *p_work_thread : server_config.work_thread);
 
-    server_manager *manager = server_manager_create(port, work_thread);
+    mem_use_allocator(server_config.allocator);        // before any loop thread starts
+    epoller_set_backend(server_config.io_backend);
+    epoller_set_max_events(server_config.max_events);
+    event_loop_set_busy_poll(server_config.busy_poll);
+    event_set_edge_triggered(server_config.edge_triggered);
+    connection_set_context_size(sizeof(request));
+    server_manager *manager = server_manager_create(port, work_thread, server_config.cpu_affinity);
+    manager->reuse_port = server_config.reuse_port;
+    manager->accept_budget = server_config.accept_budget;
+    manager->dispatch_policy = server_config.dispatch_policy;
+    manager->busy_poll_socket = server_config.busy_poll_socket;
+    server_manager_enable_rebalance(manager, server_config.rebalance_interval);
+    server_manager_enable_stats(manager, server_config.stats_interval);
 	inet_address addr = addr_create(host, port);
 	listener_create(manager, addr, onMessage, onConnection);
 	server_manager_run(manager);